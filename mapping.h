@@ -17,6 +17,187 @@ typedef uint16_t PixelIndex;
 typedef uint32_t PixelIndex;
 #endif
 
+// A set of pixels stored as a bitmap, one bit per pixel up to LED_COUNT. Membership is a bit test, and sets combine with & | ~.
+// Iterates in ascending pixel order. 44 bytes for 300 pixels, where a std::set costs ~20 bytes per member.
+class PixelSet {
+  static constexpr unsigned wordCount = (LED_COUNT + 31) / 32;
+  uint32_t words[wordCount] = {0};
+
+  void clearUnusedBits() {
+    if (LED_COUNT % 32) {
+      words[wordCount - 1] &= (1ul << (LED_COUNT % 32)) - 1;
+    }
+  }
+public:
+  uint32_t version = 0; // bumped on every change, so caches built from the set know to rebuild
+
+  PixelSet() { }
+  PixelSet(std::initializer_list<PixelIndex> pixels) {
+    for (PixelIndex pixel : pixels) {
+      insert(pixel);
+    }
+  }
+  // from a std::vector, std::set etc. of pixels
+  template <typename Container>
+  explicit PixelSet(const Container &pixels) {
+    for (PixelIndex pixel : pixels) {
+      insert(pixel);
+    }
+  }
+
+  static PixelSet all() {
+    PixelSet set;
+    set.fill();
+    return set;
+  }
+
+  inline bool contains(PixelIndex pixel) const {
+    return pixel < LED_COUNT && (words[pixel / 32] & (1ul << (pixel % 32)));
+  }
+
+  void insert(PixelIndex pixel) {
+    assert(pixel < LED_COUNT, "pixel %i out of range for PixelSet", pixel);
+    if (pixel < LED_COUNT) {
+      words[pixel / 32] |= 1ul << (pixel % 32);
+      ++version;
+    }
+  }
+
+  void erase(PixelIndex pixel) {
+    if (pixel < LED_COUNT) {
+      words[pixel / 32] &= ~(1ul << (pixel % 32));
+      ++version;
+    }
+  }
+
+  void clear() {
+    memset(words, 0, sizeof(words));
+    ++version;
+  }
+
+  void fill() {
+    memset(words, 0xFF, sizeof(words));
+    clearUnusedBits();
+    ++version;
+  }
+
+  unsigned size() const {
+    unsigned count = 0;
+    for (unsigned w = 0; w < wordCount; ++w) {
+      count += __builtin_popcountl(words[w]);
+    }
+    return count;
+  }
+
+  bool empty() const {
+    for (unsigned w = 0; w < wordCount; ++w) {
+      if (words[w]) return false;
+    }
+    return true;
+  }
+
+  // the nth pixel in the set, for picking a random member
+  PixelIndex at(unsigned n) const {
+    for (unsigned w = 0; w < wordCount; ++w) {
+      unsigned count = __builtin_popcountl(words[w]);
+      if (n < count) {
+        uint32_t word = words[w];
+        while (n--) {
+          word &= word - 1; // drop lowest set bit
+        }
+        return w * 32 + __builtin_ctzl(word);
+      }
+      n -= count;
+    }
+    assert(false, "PixelSet index out of range");
+    return 0;
+  }
+
+  // first pixel in the set at or after `from`, or LED_COUNT if there are none
+  unsigned next(unsigned from) const {
+    unsigned w = from / 32;
+    if (w >= wordCount) {
+      return LED_COUNT;
+    }
+    uint32_t word = words[w] & (~0ul << (from % 32));
+    while (!word) {
+      if (++w == wordCount) {
+        return LED_COUNT;
+      }
+      word = words[w];
+    }
+    return w * 32 + __builtin_ctzl(word);
+  }
+
+  PixelSet &operator&=(const PixelSet &other) {
+    for (unsigned w = 0; w < wordCount; ++w) {
+      words[w] &= other.words[w];
+    }
+    ++version;
+    return *this;
+  }
+
+  PixelSet &operator|=(const PixelSet &other) {
+    for (unsigned w = 0; w < wordCount; ++w) {
+      words[w] |= other.words[w];
+    }
+    ++version;
+    return *this;
+  }
+
+  PixelSet operator&(const PixelSet &other) const {
+    PixelSet result = *this;
+    return result &= other;
+  }
+
+  PixelSet operator|(const PixelSet &other) const {
+    PixelSet result = *this;
+    return result |= other;
+  }
+
+  PixelSet operator~() const {
+    PixelSet result;
+    for (unsigned w = 0; w < wordCount; ++w) {
+      result.words[w] = ~words[w];
+    }
+    result.clearUnusedBits();
+    return result;
+  }
+
+  bool operator==(const PixelSet &other) const {
+    return memcmp(words, other.words, sizeof(words)) == 0;
+  }
+
+  bool operator!=(const PixelSet &other) const {
+    return !(*this == other);
+  }
+
+  class iterator {
+    const PixelSet &set;
+    unsigned pixel;
+  public:
+    iterator(const PixelSet &set, unsigned pixel) : set(set), pixel(set.next(pixel)) { }
+    PixelIndex operator*() const { return pixel; }
+    iterator &operator++() { pixel = set.next(pixel + 1); return *this; }
+    bool operator!=(const iterator &other) const { return pixel != other.pixel; }
+  };
+
+  iterator begin() const { return iterator(*this, 0); }
+  iterator end() const { return iterator(*this, LED_COUNT); }
+};
+
+// most edges out of one vertex that allocation-free adjacency searches (e.g. ParticleSim flow) can hold
+#ifndef GRAPH_MAX_DEGREE
+#define GRAPH_MAX_DEGREE 8
+#endif
+
+// indexes the edges of a frozen Graph, sized for GRAPH_MAX_DEGREE edges out of every pixel
+#if LED_COUNT * GRAPH_MAX_DEGREE <= 0xFFFF
+typedef uint16_t EdgeIndex;
+#else
+typedef uint32_t EdgeIndex;
+#endif
+
 class DefaultEdgeType {
 public:
   enum {
@@ -61,8 +242,10 @@ struct Edge {
   // used to navigate pixel intersections with multiple edges with the same edge type. 
   // If A->B->C but G->B->H also, A->C and G->H can be continueTo.
   bool continueTo = false;
+  uint8_t weight = 1; // relative chance of following this edge in weighted flows, 0 for never
   
-  Edge(PixelIndex from, PixelIndex to, EdgeTypes types, bool continueTo=false) : from(from), to(to), types(types), continueTo(continueTo) {};
+  constexpr Edge() : from(0), to(0), types(none) {};
+  constexpr Edge(PixelIndex from, PixelIndex to, EdgeTypes types, bool continueTo=false, uint8_t weight=1) : from(from), to(to), types(types), continueTo(continueTo), weight(weight) {};
 
   Edge transpose(std::map<uint8_t,uint8_t> &typesMap) {
     EdgeTypes newTypes = none;
@@ -71,7 +254,7 @@ struct Edge {
         newTypes |= typePair.second;
       }
     }
-    return Edge(to, from, newTypes, continueTo);
+    return Edge(to, from, newTypes, continueTo, weight);
   };
 };
 
@@ -123,106 +306,929 @@ EdgeTypesQuad MakeEdgeTypesQuad(std::vector<EdgeTypes> vec) {
   return pair;
 }
 
+// Graph data in the frozen CSR layout (see Graph::freeze), built at compile time so it can live in flash.
+// Make one with the generators below as a global constexpr and hand it to Graph's constructor, which doesn't copy it:
+//   GRAPH_STORAGE constexpr auto ringData = ringGraph<LED_COUNT>();
+//   Graph graph(ringData);
+// That graph takes no heap and no startup time, but like any frozen graph it can't change.
+template <unsigned VERTICES, unsigned EDGES>
+struct StaticGraph {
+  static_assert(EDGES <= (EdgeIndex)~0, "too many edges for EdgeIndex, raise GRAPH_MAX_DEGREE");
+  Edge edges[EDGES ?: 1];
+  EdgeIndex offsets[VERTICES + 1];
+};
+
+// const data is already in flash on RP2040, Teensy 4 copies it to RAM unless told otherwise
+#if defined(__IMXRT1062__)
+#define GRAPH_STORAGE PROGMEM
+#else
+#define GRAPH_STORAGE
+#endif
+
+// From a list of directed edges, kept in their listed order per vertex. Unlike addEdge, there's no transposeMap here,
+// so list both directions of two-way connections.
+template <unsigned VERTICES, unsigned EDGES>
+constexpr StaticGraph<VERTICES, EDGES> makeStaticGraph(const Edge (&edges)[EDGES]) {
+  StaticGraph<VERTICES, EDGES> graph = {};
+  // counting sort by from
+  for (unsigned e = 0; e < EDGES; ++e) {
+    ++graph.offsets[edges[e].from + 1];
+  }
+  for (unsigned v = 0; v < VERTICES; ++v) {
+    graph.offsets[v + 1] += graph.offsets[v];
+  }
+  EdgeIndex filled[VERTICES + 1] = {};
+  for (unsigned e = 0; e < EDGES; ++e) {
+    PixelIndex from = edges[e].from;
+    graph.edges[graph.offsets[from] + filled[from]++] = edges[e];
+  }
+  return graph;
+}
+
+// pixels 0 to COUNT-1 in a line, the same edges as Graph(int count) minus the wraparound
+template <unsigned COUNT>
+constexpr StaticGraph<COUNT, 2 * (COUNT - 1)> stripGraph(EdgeTypes forward=DefaultEdgeType::increment, EdgeTypes backward=DefaultEdgeType::decrement) {
+  StaticGraph<COUNT, 2 * (COUNT - 1)> graph = {};
+  unsigned e = 0;
+  for (unsigned i = 0; i < COUNT; ++i) {
+    graph.offsets[i] = e;
+    if (i + 1 < COUNT) {
+      graph.edges[e++] = Edge(i, i + 1, forward);
+    }
+    if (i > 0) {
+      graph.edges[e++] = Edge(i, i - 1, backward);
+    }
+  }
+  graph.offsets[COUNT] = e;
+  return graph;
+}
+
+// pixels 0 to COUNT-1 in a loop, the same edges as Graph(int count)
+template <unsigned COUNT>
+constexpr StaticGraph<COUNT, 2 * COUNT> ringGraph(EdgeTypes forward=DefaultEdgeType::increment, EdgeTypes backward=DefaultEdgeType::decrement) {
+  static_assert(COUNT >= 3, "rings need at least 3 pixels");
+  StaticGraph<COUNT, 2 * COUNT> graph = {};
+  for (unsigned i = 0; i < COUNT; ++i) {
+    graph.offsets[i] = 2 * i;
+    graph.edges[2 * i] = Edge(i, (i + 1) % COUNT, forward);
+    graph.edges[2 * i + 1] = Edge(i, (i + COUNT - 1) % COUNT, backward);
+  }
+  graph.offsets[COUNT] = 2 * COUNT;
+  return graph;
+}
+
+// A WIDTH x HEIGHT grid numbered by rows, each pixel connected to its four neighbors.
+// Serpentine grids run every other row right to left, as zigzag-wired matrices do.
+template <unsigned WIDTH, unsigned HEIGHT>
+constexpr StaticGraph<WIDTH * HEIGHT, 2 * (WIDTH - 1) * HEIGHT + 2 * WIDTH * (HEIGHT - 1)> gridGraph(EdgeTypes right, EdgeTypes left,
+    EdgeTypes down, EdgeTypes up, bool serpentine=false) {
+  StaticGraph<WIDTH * HEIGHT, 2 * (WIDTH - 1) * HEIGHT + 2 * WIDTH * (HEIGHT - 1)> graph = {};
+  auto pixel = [serpentine](unsigned x, unsigned y) -> unsigned {
+    return y * WIDTH + (serpentine && (y & 1) ? WIDTH - 1 - x : x);
+  };
+  unsigned e = 0;
+  for (unsigned i = 0; i < WIDTH * HEIGHT; ++i) {
+    unsigned y = i / WIDTH;
+    unsigned x = (serpentine && (y & 1) ? WIDTH - 1 - i % WIDTH : i % WIDTH);
+    graph.offsets[i] = e;
+    if (x + 1 < WIDTH) {
+      graph.edges[e++] = Edge(i, pixel(x + 1, y), right);
+    }
+    if (x > 0) {
+      graph.edges[e++] = Edge(i, pixel(x - 1, y), left);
+    }
+    if (y + 1 < HEIGHT) {
+      graph.edges[e++] = Edge(i, pixel(x, y + 1), down);
+    }
+    if (y > 0) {
+      graph.edges[e++] = Edge(i, pixel(x, y - 1), up);
+    }
+  }
+  graph.offsets[WIDTH * HEIGHT] = e;
+  return graph;
+}
+
 class Graph {
+  // Frozen CSR (compressed sparse row) layout, see freeze(): vertex v's edges are frozenEdges[frozenOffsets[v]] up to
+  // frozenEdges[frozenOffsets[v+1]]
+  std::vector<Edge> frozenEdges;
+  std::vector<EdgeIndex> frozenOffsets;
+  std::vector<PixelIndex> searchQueue; // scratch for searches, kept to save reallocating
+  // or a StaticGraph's, which the graph doesn't own
+  const Edge *staticEdges = NULL;
+  const EdgeIndex *staticOffsets = NULL;
+  unsigned staticVertexCount = 0;
+
+  inline const Edge *csrEdges() const {
+    return (staticOffsets ? staticEdges : frozenEdges.data());
+  }
+  inline const EdgeIndex *csrOffsets() const {
+    return (staticOffsets ? staticOffsets : frozenOffsets.data());
+  }
+
+  // adds newEdge, or merges its types into the edge already going the same way
+  void mergeEdge(const Edge &newEdge) {
+    for (Edge &edge : adjList[newEdge.from]) {
+      if (edge.to == newEdge.to) {
+        edge.types |= newEdge.types;
+        return;
+      }
+    }
+    adjList[newEdge.from].push_back(newEdge);
+  }
+
+  inline const Edge *edgesBegin(PixelIndex vertex) const {
+    return (frozen() ? csrEdges() + csrOffsets()[vertex] : adjList[vertex].data());
+  }
+  inline const Edge *edgesEnd(PixelIndex vertex) const {
+    return (frozen() ? csrEdges() + csrOffsets()[vertex + 1] : adjList[vertex].data() + adjList[vertex].size());
+  }
 public:
-  std::vector<std::vector<Edge> > adjList;
+  std::vector<std::vector<Edge> > adjList; // empty once frozen
   std::map<EdgeTypes,EdgeTypes> transposeMap;
+  uint32_t version = 0; // bumped by addEdge, so caches built from the graph know to rebuild. Bump it yourself if you edit adjList directly.
   Graph() { }
   Graph(std::vector<Edge> const &edges, int count) {
     adjList.resize(count);
-
-    for (auto &edge : edges) {
-      addEdge(edge);
-    }
+    addEdges(edges);
   }
+  // frozen, over data built at compile time. The StaticGraph must outlive the Graph
+  template <unsigned VERTICES, unsigned EDGES>
+  Graph(const StaticGraph<VERTICES, EDGES> &data) : staticEdges(data.edges), staticOffsets(data.offsets), staticVertexCount(VERTICES) { }
   Graph(int count) {
     // index connected linear map
+    std::vector<Edge> edges;
+    edges.reserve(2 * count);
     for (int i = 0; i < count; ++i) {
-      addEdge(Edge(i, (i+1)%count, DefaultEdgeType::increment));
-      addEdge(Edge((i+1)%count, i, DefaultEdgeType::decrement));
+      edges.push_back(Edge(i, (i+1)%count, DefaultEdgeType::increment));
+      edges.push_back(Edge((i+1)%count, i, DefaultEdgeType::decrement));
     }
+    addEdges(edges);
   }
 
   void addEdge(Edge newEdge, bool bidirectional=true) {
+    if (frozen()) {
+      assert(false, "can't add edges to a frozen Graph");
+      return;
+    }
+    ++version;
     for (int i = adjList.size()-1; i < max(newEdge.from, newEdge.to); ++i) {
       // Add empty buckets to make adjList cover the known needed size
       adjList.emplace_back();
     }
-    bool forwardFound = false, reverseFound = false;
-    for (Edge &edge : adjList[newEdge.from]) {
-      if (edge.to == newEdge.to) {
-        edge.types |= newEdge.types;
-        forwardFound = true;
-        break;
+    mergeEdge(newEdge);
+    if (bidirectional) {
+      mergeEdge(newEdge.transpose(transposeMap));
+    }
+  }
+
+  // Bulk addEdge: the same graph as calling addEdge on each edge in turn, but grouped and deduped in one linear pass
+  // with transposeMap flattened into a lookup table. Use this for anything bigger than a handful of edges.
+  void addEdges(const std::vector<Edge> &edges, bool bidirectional=true) {
+    if (frozen()) {
+      assert(false, "can't add edges to a frozen Graph");
+      return;
+    }
+    ++version;
+    EdgeTypes transposed[0x100];
+    for (unsigned types = 0; types < 0x100; ++types) {
+      transposed[types] = transpose(types);
+    }
+    unsigned vertexCount = adjList.size();
+    for (const Edge &edge : edges) {
+      vertexCount = max(vertexCount, (unsigned)max(edge.from, edge.to) + 1);
+    }
+
+    // existing edges first, then each new edge and its reverse, in the order addEdge would meet them
+    auto forEachEdge = [&](auto &&fn) {
+      for (std::vector<Edge> &adj : adjList) {
+        for (Edge &edge : adj) {
+          fn(edge);
+        }
       }
+      for (const Edge &edge : edges) {
+        fn(edge);
+        if (bidirectional) {
+          fn(Edge(edge.to, edge.from, transposed[edge.types], edge.continueTo, edge.weight));
+        }
+      }
+    };
+
+    // counting sort by from, which keeps that order within each vertex
+    std::vector<uint32_t> offsets(vertexCount + 1, 0);
+    forEachEdge([&](const Edge &edge) {
+      ++offsets[edge.from + 1];
+    });
+    for (unsigned v = 0; v < vertexCount; ++v) {
+      offsets[v + 1] += offsets[v];
     }
-    if (bidirectional) {
-      for (Edge &edge : adjList[newEdge.to]) {
-        if (edge.from == newEdge.from) {
-          edge.types |= newEdge.transpose(transposeMap).types;
-          reverseFound = true;
-          break;
+    std::vector<Edge> grouped(offsets[vertexCount]);
+    {
+      std::vector<uint32_t> filled(offsets.begin(), offsets.end() - 1);
+      forEachEdge([&](const Edge &edge) {
+        grouped[filled[edge.from]++] = edge;
+      });
+    }
+
+    // dedupe each vertex's edges by `to`, merging types into the first. seenBy[to] is the vertex that last saw `to` (+1)
+    std::vector<uint32_t> seenBy(vertexCount, 0);
+    std::vector<uint32_t> seenAt(vertexCount);
+    std::vector<std::vector<Edge> >(vertexCount).swap(adjList);
+    uint32_t kept = 0;
+    for (unsigned v = 0; v < vertexCount; ++v) {
+      uint32_t first = kept;
+      for (uint32_t i = offsets[v]; i < offsets[v + 1]; ++i) {
+        PixelIndex to = grouped[i].to;
+        if (seenBy[to] == v + 1) {
+          grouped[seenAt[to]].types |= grouped[i].types;
+        } else {
+          seenBy[to] = v + 1;
+          seenAt[to] = kept;
+          grouped[kept++] = grouped[i];
         }
       }
+      adjList[v].assign(grouped.begin() + first, grouped.begin() + kept);
+    }
+  }
+
+  inline bool frozen() const {
+    return staticOffsets || !frozenOffsets.empty();
+  }
+
+  inline unsigned vertexCount() const {
+    if (staticOffsets) {
+      return staticVertexCount;
     }
-    if (!forwardFound) {
-      adjList[newEdge.from].push_back(newEdge);
+    return (frozen() ? frozenOffsets.size() - 1 : adjList.size());
+  }
+
+  // Packs adjList into one CSR block: an offset per vertex, then every edge back to back. This drops the vector header and
+  // heap block per vertex, and traversals walk one contiguous array. Queries work the same afterwards, but the graph can't change.
+  void freeze() {
+    if (frozen()) {
+      return;
     }
-    if (bidirectional && !reverseFound) {
-      adjList[newEdge.to].push_back(newEdge.transpose(transposeMap));
+    size_t edgeCount = 0;
+    for (std::vector<Edge> &adj : adjList) {
+      edgeCount += adj.size();
     }
+    if (edgeCount > (EdgeIndex)~0) {
+      assert(false, "%u edges are too many to freeze, raise GRAPH_MAX_DEGREE", (unsigned)edgeCount);
+      return;
+    }
+    frozenEdges.reserve(edgeCount);
+    frozenOffsets.reserve(adjList.size() + 1);
+    for (std::vector<Edge> &adj : adjList) {
+      frozenOffsets.push_back(frozenEdges.size());
+      frozenEdges.insert(frozenEdges.end(), adj.begin(), adj.end());
+    }
+    frozenOffsets.push_back(frozenEdges.size());
+    std::vector<std::vector<Edge> >().swap(adjList);
+    ++version;
   }
 
-  // TODO: using std::list for adjacency search operations and returns might be a small perf win
+  // edge types as seen going the other way, through transposeMap
+  EdgeTypes transpose(EdgeTypes types) {
+    EdgeTypes transposed = Edge::none;
+    for (auto typePair : transposeMap) {
+      if (types & typePair.first) {
+        transposed |= typePair.second;
+      }
+    }
+    return transposed;
+  }
+
+  // sets the weight of the edge from->to, returns false if there is no such edge
+  bool setWeight(PixelIndex from, PixelIndex to, uint8_t weight) {
+    if (frozen()) {
+      assert(false, "can't change weights in a frozen Graph");
+      return false;
+    }
+    if (from >= adjList.size()) {
+      return false;
+    }
+    for (Edge &edge : adjList[from]) {
+      if (edge.to == to) {
+        edge.weight = weight;
+        ++version;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static inline bool edgeMatches(EdgeTypes edgeTypes, EdgeTypes matching, bool exactMatch) {
+    auto matchedTypes = (edgeTypes & matching);
+    return matching != 0 && ((matchedTypes == matching) || (!exactMatch && matchedTypes));
+  }
+
+  // The edges out of a vertex matching each of a quad's types in turn, in place. An edge matching several of the types
+  // comes up once per match. Iterate with a range-for; the edges stay valid until the graph changes.
+  class AdjacentEdges {
+    const Edge *first, *last;
+    EdgeTypes types[4];
+    bool exactMatch;
+  public:
+    AdjacentEdges(const Edge *first, const Edge *last, EdgeTypesQuad quad, bool exactMatch)
+      : first(first), last(last), types{quad.edgeTypes.first, quad.edgeTypes.second, quad.edgeTypes.third, quad.edgeTypes.fourth}, exactMatch(exactMatch) { }
+
+    class iterator {
+      const AdjacentEdges &range;
+      uint8_t slot;
+      const Edge *edge;
+      // moves forward to the next match, starting at edge
+      void settle() {
+        while (slot < 4) {
+          for (; edge != range.last; ++edge) {
+            if (edgeMatches(edge->types, range.types[slot], range.exactMatch)) {
+              return;
+            }
+          }
+          ++slot;
+          edge = range.first;
+        }
+      }
+    public:
+      iterator(const AdjacentEdges &range, uint8_t slot) : range(range), slot(slot), edge(range.first) {
+        settle();
+      }
+      const Edge &operator*() const { return *edge; }
+      const Edge *operator->() const { return edge; }
+      iterator &operator++() { ++edge; settle(); return *this; }
+      bool operator!=(const iterator &other) const { return slot != other.slot || (slot < 4 && edge != other.edge); }
+    };
+
+    iterator begin() const { return iterator(*this, 0); }
+    iterator end() const { return iterator(*this, 4); }
+  };
+
+  AdjacentEdges adjacent(PixelIndex vertex, EdgeTypesQuad quad, bool exactMatch=false) const {
+    return AdjacentEdges(edgesBegin(vertex), edgesEnd(vertex), quad, exactMatch);
+  }
+
+  AdjacentEdges adjacent(PixelIndex vertex, EdgeTypesPair pair, bool exactMatch=false) const {
+    return adjacent(vertex, MakeEdgeTypesQuad(pair.edgeTypes.first, pair.edgeTypes.second), exactMatch);
+  }
+
+  // Calls fn(const Edge &) on each edge adjacent() yields, the same edges in the same order as adjacencies() without the copies
+  template <typename Fn>
+  void forEachAdjacent(PixelIndex vertex, EdgeTypesQuad quad, Fn fn, bool exactMatch=false) const {
+    EdgeTypes types[4] = {quad.edgeTypes.first, quad.edgeTypes.second, quad.edgeTypes.third, quad.edgeTypes.fourth};
+    const Edge *begin = edgesBegin(vertex), *end = edgesEnd(vertex);
+    for (EdgeTypes matching : types) {
+      if (matching == 0) {
+        continue;
+      }
+      for (const Edge *edge = begin; edge != end; ++edge) {
+        if (edgeMatches(edge->types, matching, exactMatch)) {
+          fn(*edge);
+        }
+      }
+    }
+  }
+
+  template <typename Fn>
+  void forEachAdjacent(PixelIndex vertex, EdgeTypesPair pair, Fn fn, bool exactMatch=false) const {
+    forEachAdjacent(vertex, MakeEdgeTypesQuad(pair.edgeTypes.first, pair.edgeTypes.second), fn, exactMatch);
+  }
 
   std::vector<Edge> adjacencies(PixelIndex vertex, EdgeTypesPair pair, bool exactMatch=false) {
-    std::vector<Edge> adjList;
-    getAdjacencies(vertex, pair.edgeTypes.first, adjList, exactMatch);
-    getAdjacencies(vertex, pair.edgeTypes.second, adjList, exactMatch);
-    return adjList;
+    return adjacencies(vertex, MakeEdgeTypesQuad(pair.edgeTypes.first, pair.edgeTypes.second), exactMatch);
   }
 
   std::vector<Edge> adjacencies(PixelIndex vertex, EdgeTypesQuad quad, bool exactMatch=false) {
     std::vector<Edge> adjList;
-    getAdjacencies(vertex, quad.edgeTypes.first, adjList, exactMatch);
-    getAdjacencies(vertex, quad.edgeTypes.second, adjList, exactMatch);
-    getAdjacencies(vertex, quad.edgeTypes.third, adjList, exactMatch);
-    getAdjacencies(vertex, quad.edgeTypes.fourth, adjList, exactMatch);
+    forEachAdjacent(vertex, quad, [&](const Edge &edge) {
+      adjList.push_back(edge);
+    }, exactMatch);
     return adjList;
   }
 
   void getAdjacencies(PixelIndex vertex, EdgeTypes matching, std::vector<Edge> &insertInto, bool exactMatch) {
-    if (matching == 0) {
-      return;
-    }
-    std::vector<Edge> &adj = adjList[vertex];
-    for (Edge &edge : adj) {
-      auto matchedTypes = (edge.types & matching);
-      if ((matchedTypes == matching) || (!exactMatch && matchedTypes)) {
-        insertInto.push_back(edge);
+    forEachAdjacent(vertex, EdgeTypesQuad(matching), [&](const Edge &edge) {
+      insertInto.push_back(edge);
+    }, exactMatch);
+  }
+
+  // Fills `out` with pointers into the graph for the edges adjacent() yields and returns how many there are
+  unsigned getAdjacencies(PixelIndex vertex, EdgeTypesQuad quad, bool exactMatch, const Edge **out, unsigned capacity) {
+    unsigned count = 0;
+    forEachAdjacent(vertex, quad, [&](const Edge &edge) {
+      if (count < capacity) {
+        out[count] = &edge;
       }
+      ++count;
+    }, exactMatch);
+    if (count > capacity) {
+      assert(false, "vertex %i has more than %u matching adjacencies, raise GRAPH_MAX_DEGREE", vertex, capacity);
+      return capacity;
     }
+    return count;
   }
 
   // breadth-first reachability
   std::vector<PixelIndex> bfr(PixelIndex start, EdgeTypes edgeType, bool exactMatch=false) {
     std::vector<PixelIndex> result;
-    std::vector<bool> visited(adjList.size(), false);
+    std::vector<bool> visited(vertexCount(), false);
     visited[start] = true;
     result.push_back(start);
     // Use result vector as the queue; `front` tracks dequeue position
     for (size_t front = 0; front < result.size(); ++front) {
-      std::vector<Edge> &adj = adjList[result[front]];
-      for (Edge &edge : adj) {
-        auto matched = edge.types & edgeType;
-        if ((exactMatch ? matched == edgeType : matched) && !visited[edge.to]) {
+      forEachAdjacent(result[front], EdgeTypesQuad(edgeType), [&](const Edge &edge) {
+        if (!visited[edge.to]) {
           visited[edge.to] = true;
           result.push_back(edge.to);
         }
-      }
+      }, exactMatch);
     }
     return result;
   }
+
+  // Hop distances from the nearest of sources along edges matching edgeTypes, into distances[0, vertexCount()).
+  // Unreachable pixels get the Distance type's max and farther ones saturate just below it, so uint8_t fields top out at 254 hops.
+  // Sources is anything iterable of pixels, e.g. a PixelSet. Doesn't allocate once the search queue has grown to the graph.
+  template <typename Distance, typename Sources>
+  void distanceField(const Sources &sources, Distance *distances, EdgeTypes edgeTypes=Edge::all, bool exactMatch=false) {
+    const Distance unreached = (Distance)~0;
+    unsigned count = vertexCount();
+    if (searchQueue.size() < count) {
+      searchQueue.resize(count);
+    }
+    PixelIndex *queue = searchQueue.data();
+    for (unsigned v = 0; v < count; ++v) {
+      distances[v] = unreached;
+    }
+    unsigned head = 0, tail = 0;
+    for (PixelIndex source : sources) {
+      if (source < count && distances[source] != 0) {
+        distances[source] = 0;
+        queue[tail++] = source;
+      }
+    }
+    while (head < tail) {
+      PixelIndex vertex = queue[head++];
+      Distance next = min(distances[vertex] + 1, unreached - 1);
+      forEachAdjacent(vertex, EdgeTypesQuad(edgeTypes), [&](const Edge &edge) {
+        if (distances[edge.to] == unreached) {
+          distances[edge.to] = next;
+          queue[tail++] = edge.to;
+        }
+      }, exactMatch);
+    }
+  }
+
+  template <typename Distance>
+  void distanceField(PixelIndex source, Distance *distances, EdgeTypes edgeTypes=Edge::all, bool exactMatch=false) {
+    PixelIndex sources[1] = {source};
+    distanceField(sources, distances, edgeTypes, exactMatch);
+  }
+};
+
+// Distance fields kept across frames by id, recomputed only when their sources, edge filter or the graph change.
+// Ripples then cost a lookup per pixel:
+//   const uint8_t *hops = fields.get(rippleField, rippleSources);
+//   for (...) ctx.point(px, color, blendBrighten, hops[px] == rippleFront ? 0xFF : 0);
+template <typename Distance=uint8_t>
+class DistanceFields {
+  struct Field {
+    unsigned id;
+    PixelSet sources;
+    EdgeTypes edgeTypes;
+    bool exactMatch;
+    uint32_t graphVersion;
+    std::vector<Distance> distances;
+  };
+  Graph &graph;
+  std::vector<Field> fields;
+
+public:
+  DistanceFields(Graph &graph) : graph(graph) { }
+
+  // the field for id, computed from sources if it hasn't been yet or anything changed since. Valid until the next get() for id
+  const Distance *get(unsigned id, const PixelSet &sources, EdgeTypes edgeTypes=Edge::all, bool exactMatch=false) {
+    Field *field = NULL;
+    for (Field &f : fields) {
+      if (f.id == id) {
+        field = &f;
+        break;
+      }
+    }
+    if (!field) {
+      fields.push_back(Field{id, sources, edgeTypes, exactMatch, graph.version - 1, {}});
+      field = &fields.back();
+    } else if (field->graphVersion == graph.version && field->edgeTypes == edgeTypes && field->exactMatch == exactMatch
+               && field->sources == sources && field->distances.size() == graph.vertexCount()) {
+      return field->distances.data();
+    }
+    field->sources = sources;
+    field->edgeTypes = edgeTypes;
+    field->exactMatch = exactMatch;
+    field->graphVersion = graph.version;
+    field->distances.resize(graph.vertexCount());
+    graph.distanceField(sources, field->distances.data(), edgeTypes, exactMatch);
+    return field->distances.data();
+  }
+
+  void forget(unsigned id) {
+    for (unsigned i = 0; i < fields.size(); ++i) {
+      if (fields[i].id == id) {
+        fields.erase(fields.begin() + i);
+        return;
+      }
+    }
+  }
+
+  void clear() {
+    fields.clear();
+  }
+};
+
+// A breadth-first search that expands one layer per step(), for lighting a wave's frontier a hop per tick:
+//   wave.start(px);
+//   ...each tick: for (PixelIndex px : wave) { ctx.point(px, color); } wave.step();
+// A step costs the frontier's size and edges, not the graph's, and nothing allocates once the layers have grown.
+class BreadthFirstWave {
+  Graph &graph;
+  std::vector<bool> visited; // [vertex], sized from the graph rather than LED_COUNT since graphs can have vertices past it
+  std::vector<PixelIndex> frontier;
+  std::vector<PixelIndex> nextFrontier;
+  unsigned layer = 0;
+
+  // marks pixel visited, returns false if it already was
+  bool visit(PixelIndex pixel) {
+    if (pixel >= visited.size()) {
+      visited.resize(pixel + 1, false);
+    } else if (visited[pixel]) {
+      return false;
+    }
+    visited[pixel] = true;
+    return true;
+  }
+public:
+  EdgeTypes edgeTypes;
+  bool exactMatch;
+
+  BreadthFirstWave(Graph &graph, EdgeTypes edgeTypes=Edge::all, bool exactMatch=false) : graph(graph), edgeTypes(edgeTypes), exactMatch(exactMatch) { }
+
+  // restarts the wave at sources, which are the first layer
+  template <typename Sources>
+  void start(const Sources &sources) {
+    visited.assign(graph.vertexCount(), false);
+    frontier.clear();
+    layer = 0;
+    for (PixelIndex source : sources) {
+      if (visit(source)) {
+        frontier.push_back(source);
+      }
+    }
+  }
+
+  void start(PixelIndex source) {
+    PixelIndex sources[1] = {source};
+    start(sources);
+  }
+
+  // moves the frontier out a hop, to pixels no earlier layer reached. Returns false once there's nothing left
+  bool step() {
+    nextFrontier.clear();
+    for (PixelIndex vertex : frontier) {
+      graph.forEachAdjacent(vertex, EdgeTypesQuad(edgeTypes), [&](const Edge &edge) {
+        if (visit(edge.to)) {
+          nextFrontier.push_back(edge.to);
+        }
+      }, exactMatch);
+    }
+    frontier.swap(nextFrontier);
+    ++layer;
+    return !frontier.empty();
+  }
+
+  // hops from the sources to the current frontier
+  unsigned depth() const {
+    return layer;
+  }
+
+  bool done() const {
+    return frontier.empty();
+  }
+
+  // whether any layer so far, the current one included, reached pixel
+  bool reached(PixelIndex pixel) const {
+    return pixel < visited.size() && visited[pixel];
+  }
+
+  // the current frontier
+  const std::vector<PixelIndex> &pixels() const {
+    return frontier;
+  }
+  std::vector<PixelIndex>::const_iterator begin() const { return frontier.begin(); }
+  std::vector<PixelIndex>::const_iterator end() const { return frontier.end(); }
+};
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// fixed point, in whatever units the layout uses (e.g. 1/10 mm from the PCB)
+typedef int16_t Coordinate;
+
+// Physical positions of pixels in 2D or 3D, with a uniform grid index for radius, box and nearest-pixel queries.
+// The grid has about one cell per pixel, so queries visit roughly the cells their answer covers rather than every pixel.
+// It's rebuilt on the first query after set().
+template <uint8_t DIMENSIONS=2>
+class PixelCoordinates {
+  static_assert(DIMENSIONS == 2 || DIMENSIONS == 3, "PixelCoordinates are 2D or 3D");
+public:
+  struct Point {
+    Coordinate axis[DIMENSIONS];
+    Point() : axis{} { }
+    Point(Coordinate x, Coordinate y, Coordinate z=0) : axis{} {
+      axis[0] = x;
+      axis[1] = y;
+      if constexpr (DIMENSIONS > 2) {
+        axis[2] = z;
+      }
+    }
+    Coordinate x() const { return axis[0]; }
+    Coordinate y() const { return axis[1]; }
+    Coordinate z() const {
+      if constexpr (DIMENSIONS > 2) {
+        return axis[2];
+      }
+      return 0;
+    }
+  };
+
+private:
+  std::vector<Point> points; // [pixel]
+  bool indexed = false;
+  Point low, high; // bounds of all points
+  Coordinate cellSize = 1;
+  unsigned cellCounts[DIMENSIONS];
+  std::vector<uint32_t> cellStarts; // [cell] -> first of its pixels in cellPixels, plus one past the end
+  std::vector<PixelIndex> cellPixels;
+
+  inline unsigned cellAlong(uint8_t d, int32_t coordinate) const {
+    int32_t cell = (coordinate - low.axis[d]) / cellSize;
+    return (unsigned)constrain(cell, (int32_t)0, (int32_t)cellCounts[d] - 1);
+  }
+
+  // row-major cell number from per-axis cell positions
+  inline unsigned cellNumber(const unsigned *cell) const {
+    unsigned number = 0;
+    for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+      number = number * cellCounts[d] + cell[d];
+    }
+    return number;
+  }
+
+  static inline uint64_t distanceSquared(const Point &a, const Point &b) {
+    uint64_t sum = 0;
+    for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+      int32_t delta = (int32_t)a.axis[d] - b.axis[d];
+      sum += (uint64_t)((int64_t)delta * delta);
+    }
+    return sum;
+  }
+
+  void buildIndex() {
+    unsigned count = points.size();
+    for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+      low.axis[d] = high.axis[d] = (count ? points[0].axis[d] : 0);
+    }
+    for (const Point &point : points) {
+      for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+        low.axis[d] = min(low.axis[d], point.axis[d]);
+        high.axis[d] = max(high.axis[d], point.axis[d]);
+      }
+    }
+    // cells about as big as the layout's volume per pixel, ignoring flat axes
+    float volume = 1;
+    uint8_t spread = 0;
+    for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+      if (high.axis[d] > low.axis[d]) {
+        volume *= (float)high.axis[d] - low.axis[d] + 1;
+        ++spread;
+      }
+    }
+    cellSize = (spread && count ? (Coordinate)constrain(ceilf(powf(volume / count, 1.0f / spread)), 1.0f, 32767.0f) : 1);
+    unsigned cellCount = 1;
+    for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+      cellCounts[d] = ((int32_t)high.axis[d] - low.axis[d]) / cellSize + 1;
+      cellCount *= cellCounts[d];
+    }
+
+    // counting sort of pixels by cell
+    cellStarts.assign(cellCount + 1, 0);
+    unsigned cell[DIMENSIONS];
+    for (const Point &point : points) {
+      for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+        cell[d] = cellAlong(d, point.axis[d]);
+      }
+      ++cellStarts[cellNumber(cell) + 1];
+    }
+    for (unsigned c = 0; c < cellCount; ++c) {
+      cellStarts[c + 1] += cellStarts[c];
+    }
+    cellPixels.resize(count);
+    std::vector<uint32_t> filled(cellStarts.begin(), cellStarts.end() - 1);
+    for (unsigned px = 0; px < count; ++px) {
+      for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+        cell[d] = cellAlong(d, points[px].axis[d]);
+      }
+      cellPixels[filled[cellNumber(cell)]++] = px;
+    }
+    indexed = true;
+  }
+
+  inline void ensureIndexed() {
+    if (!indexed) {
+      buildIndex();
+    }
+  }
+
+  // calls fn(pixel) for every pixel in the cells from cellLow to cellHigh inclusive
+  template <typename Fn>
+  void forEachInCells(const unsigned *cellLow, const unsigned *cellHigh, Fn fn) const {
+    unsigned cell[DIMENSIONS];
+    for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+      cell[d] = cellLow[d];
+    }
+    while (true) {
+      unsigned number = cellNumber(cell);
+      for (uint32_t i = cellStarts[number]; i < cellStarts[number + 1]; ++i) {
+        fn(cellPixels[i]);
+      }
+      // odometer over the cells, last axis fastest
+      int8_t d = DIMENSIONS - 1;
+      while (d >= 0 && cell[d] == cellHigh[d]) {
+        cell[d] = cellLow[d];
+        --d;
+      }
+      if (d < 0) {
+        return;
+      }
+      ++cell[d];
+    }
+  }
+
+public:
+  PixelCoordinates(unsigned count=LED_COUNT) : points(count) { }
+  PixelCoordinates(const Point *points, unsigned count) : points(points, points + count) { }
+
+  void set(PixelIndex pixel, Point point) {
+    points[pixel] = point;
+    indexed = false;
+  }
+
+  inline const Point &operator[](PixelIndex pixel) const {
+    return points[pixel];
+  }
+
+  inline unsigned size() const {
+    return points.size();
+  }
+
+  // the lowest and highest coordinates along each axis
+  void bounds(Point &lowest, Point &highest) {
+    ensureIndexed();
+    lowest = low;
+    highest = high;
+  }
+
+  // calls fn(pixel) for each pixel within radius of center, inclusive
+  template <typename Fn>
+  void forEachInRadius(Point center, Coordinate radius, Fn fn) {
+    ensureIndexed();
+    unsigned cellLow[DIMENSIONS], cellHigh[DIMENSIONS];
+    for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+      if ((int32_t)center.axis[d] + radius < low.axis[d] || (int32_t)center.axis[d] - radius > high.axis[d]) {
+        return;
+      }
+      cellLow[d] = cellAlong(d, (int32_t)center.axis[d] - radius);
+      cellHigh[d] = cellAlong(d, (int32_t)center.axis[d] + radius);
+    }
+    uint64_t radiusSquared = (uint64_t)((int32_t)radius * radius);
+    forEachInCells(cellLow, cellHigh, [&](PixelIndex pixel) {
+      if (distanceSquared(points[pixel], center) <= radiusSquared) {
+        fn(pixel);
+      }
+    });
+  }
+
+  // calls fn(pixel) for each pixel inside the box from corner to corner, inclusive
+  template <typename Fn>
+  void forEachInBox(Point corner1, Point corner2, Fn fn) {
+    ensureIndexed();
+    Point boxLow, boxHigh;
+    unsigned cellLow[DIMENSIONS], cellHigh[DIMENSIONS];
+    for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+      boxLow.axis[d] = min(corner1.axis[d], corner2.axis[d]);
+      boxHigh.axis[d] = max(corner1.axis[d], corner2.axis[d]);
+      if (boxHigh.axis[d] < low.axis[d] || boxLow.axis[d] > high.axis[d]) {
+        return;
+      }
+      cellLow[d] = cellAlong(d, boxLow.axis[d]);
+      cellHigh[d] = cellAlong(d, boxHigh.axis[d]);
+    }
+    forEachInCells(cellLow, cellHigh, [&](PixelIndex pixel) {
+      for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+        if (points[pixel].axis[d] < boxLow.axis[d] || points[pixel].axis[d] > boxHigh.axis[d]) {
+          return;
+        }
+      }
+      fn(pixel);
+    });
+  }
+
+  PixelSet inRadius(Point center, Coordinate radius) {
+    PixelSet pixels;
+    forEachInRadius(center, radius, [&](PixelIndex pixel) {
+      pixels.insert(pixel);
+    });
+    return pixels;
+  }
+
+  PixelSet inBox(Point corner1, Point corner2) {
+    PixelSet pixels;
+    forEachInBox(corner1, corner2, [&](PixelIndex pixel) {
+      pixels.insert(pixel);
+    });
+    return pixels;
+  }
+
+  // The pixel closest to point, or -1 if there are none. Searches outward a shell of cells at a time
+  // and stops once the next shell can't hold anything closer. Far from sparse layouts (a ring's middle, say) most cells
+  // are empty, so after as many cells as pixels it scans the pixels instead.
+  int nearest(Point point) {
+    ensureIndexed();
+    int best = -1;
+    uint64_t bestDistance = 0;
+    unsigned cellsLeft = points.size();
+    unsigned center[DIMENSIONS];
+    unsigned maxShell = 0;
+    for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+      center[d] = cellAlong(d, point.axis[d]);
+      maxShell = max(maxShell, max(center[d], cellCounts[d] - 1 - center[d]));
+    }
+    for (unsigned shell = 0; shell <= maxShell; ++shell) {
+      unsigned cellLow[DIMENSIONS], cellHigh[DIMENSIONS];
+      for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+        cellLow[d] = (center[d] > shell ? center[d] - shell : 0);
+        cellHigh[d] = min(center[d] + shell, cellCounts[d] - 1);
+      }
+      unsigned cell[DIMENSIONS];
+      for (uint8_t d = 0; d < DIMENSIONS; ++d) {
+        cell[d] = cellLow[d];
+      }
+      // visit only the cells on this shell's surface
+      const uint8_t last = DIMENSIONS - 1;
+      while (true) {
+        bool outerSurface = false; // on the surface along some axis but the last
+        for (uint8_t d = 0; d < last; ++d) {
+          outerSurface |= (cell[d] + shell == center[d] || cell[d] == center[d] + shell);
+        }
+        if (outerSurface || cell[last] + shell == center[last] || cell[last] == center[last] + shell) {
+          if (cellsLeft-- == 0) {
+            for (unsigned px = 0; px < points.size(); ++px) {
+              uint64_t distance = distanceSquared(points[px], point);
+              if (best < 0 || distance < bestDistance) {
+                best = px;
+                bestDistance = distance;
+              }
+            }
+            return best;
+          }
+          unsigned number = cellNumber(cell);
+          for (uint32_t i = cellStarts[number]; i < cellStarts[number + 1]; ++i) {
+            uint64_t distance = distanceSquared(points[cellPixels[i]], point);
+            if (best < 0 || distance < bestDistance) {
+              best = cellPixels[i];
+              bestDistance = distance;
+            }
+          }
+        }
+        if (!outerSurface && cell[last] < cellHigh[last] && cell[last] + 1 < center[last] + shell) {
+          // skip the inside of the shell along the last axis
+          cell[last] = min(center[last] + shell, cellHigh[last]);
+          continue;
+        }
+        int8_t d = last;
+        while (d >= 0 && cell[d] == cellHigh[d]) {
+          cell[d] = cellLow[d];
+          --d;
+        }
+        if (d < 0) {
+          break;
+        }
+        ++cell[d];
+      }
+      // anything past this shell is at least shell cells away along some axis
+      uint64_t reach = (uint64_t)shell * cellSize;
+      if (best >= 0 && bestDistance <= reach * reach) {
+        break;
+      }
+    }
+    return best;
+  }
 };
 
 #endif
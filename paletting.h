@@ -2,6 +2,9 @@
 #define PALETTING_H
 
 #include <FastLED.h>
+#include <vector>
+#include <list>
+#include <functional>
 #include "ext-palettes.h"
 
 // Flag colors are pulled from publically available values, then refined to render better on my SMD LEDs
@@ -230,14 +233,108 @@ const uint8_t gGradientPaletteCount =
 
 /* --- */
 
+// A gradient palette stored as its keyframes rather than expanded into a 256-entry table, for low-RAM targets.
+// Colors are interpolated between stops at lookup time, so hard band edges stay exact.
+// Costs 1 + 4*MAX_STOPS bytes
+template <uint8_t MAX_STOPS>
+struct KeyframePalette {
+  uint8_t count = 0;
+  uint8_t positions[MAX_STOPS];
+  CRGB colors[MAX_STOPS];
+
+  KeyframePalette() { }
+
+  KeyframePalette(TProgmemRGBGradientPaletteRef progpal) {
+    *this = progpal;
+  }
+
+  template <uint8_t OTHER_STOPS>
+  KeyframePalette(const KeyframePalette<OTHER_STOPS> &other) {
+    for (uint8_t i = 0; i < other.count; ++i) {
+      addStop(other.positions[i], other.colors[i]);
+    }
+  }
+
+  KeyframePalette &operator=(TProgmemRGBGradientPaletteRef progpal) {
+    // same walk as FastLED's gradient palette loader
+    TRGBGradientPaletteEntryUnion* progent = (TRGBGradientPaletteEntryUnion*)(progpal);
+    TRGBGradientPaletteEntryUnion u;
+    count = 0;
+    do {
+      u.dword = FL_PGM_READ_DWORD_NEAR(progent++);
+      addStop(u.index, CRGB(u.r, u.g, u.b));
+    } while (u.index != 255);
+    return *this;
+  }
+
+  void addStop(uint8_t position, CRGB color) {
+    assert(count < MAX_STOPS, "keyframe palette is limited to %u stops", MAX_STOPS);
+    if (count == MAX_STOPS) {
+      // overwrite the last stop so the palette still ends where the gradient does
+      --count;
+    }
+    positions[count] = position;
+    colors[count] = color;
+    ++count;
+  }
+
+  // color at index, interpolated from the last stop at or before index toward the next stop
+  CRGB colorAt(uint8_t index) const {
+    if (count == 0) {
+      return CRGB::Black;
+    }
+    if (index < positions[0]) {
+      return colors[0];
+    }
+    uint8_t lo = 0, hi = count;
+    while (hi - lo > 1) {
+      uint8_t mid = (lo + hi) / 2;
+      if (positions[mid] <= index) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo + 1 >= count) {
+      return colors[lo];
+    }
+    uint8_t span = positions[lo+1] - positions[lo];
+    return blend(colors[lo], colors[lo+1], ((index - positions[lo]) << 8) / span);
+  }
+
+  // color approaching position from below, which differs from colorAt for a hard edge made of two stops at the same position
+  CRGB colorBefore(uint8_t position) const {
+    for (uint8_t i = 0; i < count && positions[i] <= position; ++i) {
+      if (positions[i] == position) {
+        return colors[i];
+      }
+    }
+    return colorAt(position);
+  }
+};
+
+typedef KeyframePalette<16> KeyframePalette16;
+
+template <uint8_t MAX_STOPS>
+inline CRGB ColorFromPalette(const KeyframePalette<MAX_STOPS> &palette, uint8_t index, uint8_t brightness=0xFF) {
+  CRGB color = palette.colorAt(index);
+  if (brightness != 0xFF) {
+    color.nscale8(brightness);
+  }
+  return color;
+}
+
+/* --- */
+
 template <class T>
 class PaletteManager {
 private:
-  static bool paletteHasColorBelowThreshold(T &palette, uint8_t minBrightness) {
+  template <typename P>
+  static bool paletteHasColorBelowThreshold(P &palette, uint8_t minBrightness) {
     if (minBrightness == 0) {
       return false;
     }
-    for (uint16_t i = 0; i < sizeof(T)/3; ++i) {
+    for (uint16_t i = 0; i < sizeof(P)/3; ++i) {
       if (palette.entries[i].getAverageLight() < minBrightness) {
         return true;
       }
@@ -245,10 +342,11 @@ private:
     return false;
   }
 
-  static uint8_t paletteColorJump(T& palette, bool wrapped=false) {
+  template <typename P>
+  static uint8_t paletteColorJump(P& palette, bool wrapped=false) {
     uint8_t maxJump = 0;
-    CRGB lastColor = palette.entries[(wrapped ? sizeof(T)/3 - 1 : 1)];
-    for (uint16_t i = (wrapped ? 0 : 1); i < sizeof(T)/3; ++i) {
+    CRGB lastColor = palette.entries[(wrapped ? sizeof(P)/3 - 1 : 1)];
+    for (uint16_t i = (wrapped ? 0 : 1); i < sizeof(P)/3; ++i) {
       CRGB color = palette.entries[i];
       uint8_t distance = (abs((int)color.r - (int)lastColor.r) + abs((int)color.g - (int)lastColor.g) + abs((int)color.b - (int)lastColor.b)) / 3;
       if (distance > maxJump) {
@@ -259,6 +357,34 @@ private:
     return maxJump;
   }
 
+  // brightness is linear between stops, so checking the stops is enough
+  template <uint8_t MAX_STOPS>
+  static bool paletteHasColorBelowThreshold(KeyframePalette<MAX_STOPS> &palette, uint8_t minBrightness) {
+    for (uint8_t i = 0; i < palette.count; ++i) {
+      if (palette.colors[i].getAverageLight() < minBrightness) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // per-index jump along each segment, matching what the 256-entry expansion would measure
+  template <uint8_t MAX_STOPS>
+  static uint8_t paletteColorJump(KeyframePalette<MAX_STOPS>& palette, bool wrapped=false) {
+    uint8_t maxJump = 0;
+    for (uint8_t i = (wrapped ? 0 : 1); i < palette.count; ++i) {
+      uint8_t last = (i == 0 ? palette.count - 1 : i - 1);
+      CRGB color = palette.colors[i];
+      CRGB lastColor = palette.colors[last];
+      uint8_t span = max(1, (int)palette.positions[i] - (int)palette.positions[last]);
+      uint8_t distance = (abs((int)color.r - (int)lastColor.r) + abs((int)color.g - (int)lastColor.g) + abs((int)color.b - (int)lastColor.b)) / 3 / span;
+      if (distance > maxJump) {
+        maxJump = distance;
+      }
+    }
+    return maxJump;
+  }
+
 public:
   PaletteManager() { }
 
@@ -322,8 +448,222 @@ bool nblendPaletteTowardPalette(PaletteType& current, PaletteType& target, uint1
   return changes > 0;
 }
 
+/* -------------------------------------------------------------------- */
+
+// Color space used when interpolating between two colors.
+// sRGB blends are cheap but pass through muddy midpoints between saturated colors, Oklab blends are perceptually even.
+enum BlendSpace : uint8_t {
+  blendSpaceRGB, blendSpaceOklab,
+};
+
+// Oklab color, stored as cube-root LMS in Q16.
+// Oklab L,a,b is a linear transform of cube-root LMS, so interpolating here is identical to interpolating in Oklab
+// and saves two matrix multiplies per conversion.
+struct OklabLMS {
+  int32_t l, m, s;
+};
+
+// Fixed-point Oklab conversion with no float math after the tables are built, for FPU-less parts like Cortex-M0+.
+// Tables are built on first use and cost ~1KB of RAM.
+// A blend is ~600 cycles on M0+ (no divides, mostly the gamma searches in toRGB) vs ~25 for an sRGB blend,
+// so a full 256-entry palette is ~1.3ms at 125MHz vs ~60us in sRGB.
+class Oklab {
+private:
+  struct Tables {
+    uint16_t srgbToLinear[256]; // Q16 linear light for each sRGB byte
+    uint16_t cbrt[257];         // Q16 cube root of [0,1] in 1/256 steps
+    Tables() {
+      for (int i = 0; i < 256; ++i) {
+        float c = i / 255.0f;
+        float linear = (c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f));
+        srgbToLinear[i] = (uint16_t)(linear * 0xFFFF + 0.5f);
+      }
+      for (int i = 0; i <= 256; ++i) {
+        cbrt[i] = (uint16_t)min(0xFFFF, (int)(cbrtf(i / 256.0f) * 0xFFFF + 0.5f));
+      }
+    }
+  };
+
+  static Tables &tables() {
+    static Tables sharedTables;
+    return sharedTables;
+  }
+
+  // Q16 cube root. Small inputs are scaled up by 8 (halving the result) until they land in the smooth part of the table
+  static int32_t cbrt16(uint32_t x) {
+    if (x == 0) return 0;
+    uint8_t halvings = 0;
+    while (x < (1 << 13)) {
+      x <<= 3;
+      ++halvings;
+    }
+    const uint16_t *table = tables().cbrt;
+    uint16_t i = x >> 8;
+    int32_t y = table[i] + ((((int32_t)table[i+1] - table[i]) * (int32_t)(x & 0xFF)) >> 8);
+    return y >> halvings;
+  }
+
+  static uint32_t cube16(int32_t x) {
+    uint32_t v = constrain(x, (int32_t)0, (int32_t)0xFFFF);
+    return (((v * v) >> 16) * v) >> 16;
+  }
+
+  // nearest sRGB byte for Q16 linear light, by binary search of the gamma table
+  static uint8_t linearToSRGB(int32_t v) {
+    if (v <= 0) return 0;
+    if (v >= 0xFFFF) return 0xFF;
+    const uint16_t *table = tables().srgbToLinear;
+    uint8_t lo = 0;
+    for (uint8_t step = 0x80; step; step >>= 1) {
+      if (table[lo + step] <= v) {
+        lo += step;
+      }
+    }
+    if (lo < 0xFF && table[lo + 1] - v < v - table[lo]) {
+      ++lo;
+    }
+    return lo;
+  }
+
+public:
+  static OklabLMS fromRGB(CRGB color) {
+    const uint16_t *toLinear = tables().srgbToLinear;
+    uint32_t r = toLinear[color.r], g = toLinear[color.g], b = toLinear[color.b];
+    OklabLMS lms;
+    lms.l = cbrt16((6754 * r + 8787 * g +   843 * b) >> 14);
+    lms.m = cbrt16((3472 * r + 11152 * g + 1760 * b) >> 14);
+    lms.s = cbrt16((1447 * r + 4616 * g + 10321 * b) >> 14);
+    return lms;
+  }
+
+  static CRGB toRGB(OklabLMS lms) {
+    int32_t l = cube16(lms.l), m = cube16(lms.m), s = cube16(lms.s);
+    return CRGB(linearToSRGB(( 16698 * l - 13548 * m +  946 * s) >> 12),
+                linearToSRGB((- 5196 * l + 10690 * m - 1398 * s) >> 12),
+                linearToSRGB((-   17 * l -  2881 * m + 6994 * s) >> 12));
+  }
+
+  static OklabLMS lerp(OklabLMS a, OklabLMS b, fract8 amount) {
+    int32_t scale = amount + (amount >> 7); // 0..256 so that 0xFF lands exactly on b
+    OklabLMS result;
+    result.l = a.l + (((b.l - a.l) * scale) >> 8);
+    result.m = a.m + (((b.m - a.m) * scale) >> 8);
+    result.s = a.s + (((b.s - a.s) * scale) >> 8);
+    return result;
+  }
+
+  static CRGB blend(CRGB a, CRGB b, fract8 amount) {
+    if (amount == 0 || a == b) return a;
+    if (amount == 0xFF) return b;
+    return toRGB(lerp(fromRGB(a), fromRGB(b), amount));
+  }
+};
+
+inline CRGB blendInSpace(CRGB a, CRGB b, fract8 amount, BlendSpace space) {
+  return (space == blendSpaceOklab ? Oklab::blend(a, b, amount) : blend(a, b, amount));
+}
+
+// Merges the stops of two keyframe palettes so that `result` evaluates to the blend of `from` and `to` at each stop.
+// Colors between stops stay linear in sRGB, so Oklab only applies to the stop colors
+template <uint8_t RESULT_STOPS, uint8_t FROM_STOPS, uint8_t TO_STOPS>
+void blendKeyframePalettes(KeyframePalette<RESULT_STOPS>& result, const KeyframePalette<FROM_STOPS>& from, const KeyframePalette<TO_STOPS>& to, fract8 amount, BlendSpace space=blendSpaceRGB)
+{
+  static_assert(RESULT_STOPS >= FROM_STOPS + TO_STOPS, "blended keyframe palette needs room for the stops of both palettes");
+  result.count = 0;
+  uint8_t i = 0, j = 0;
+  while (i < from.count || j < to.count) {
+    bool fromNext = (j >= to.count || (i < from.count && from.positions[i] <= to.positions[j]));
+    uint8_t position = (fromNext ? from.positions[i] : to.positions[j]);
+    while (i < from.count && from.positions[i] == position) ++i;
+    while (j < to.count && to.positions[j] == position) ++j;
+
+    CRGB fromBefore = from.colorBefore(position), fromAt = from.colorAt(position);
+    CRGB toBefore = to.colorBefore(position), toAt = to.colorAt(position);
+    if (fromBefore != fromAt || toBefore != toAt) {
+      // keep the hard edge
+      result.addStop(position, blendInSpace(fromBefore, toBefore, amount, space));
+    }
+    result.addStop(position, blendInSpace(fromAt, toAt, amount, space));
+  }
+}
+
+// writes the Oklab interpolation between `from` and `to` into `result`
+template<typename PaletteType>
+void blendPaletteOklab(PaletteType& result, PaletteType& from, PaletteType& to, fract8 amount)
+{
+  const uint16_t entryCount = sizeof(PaletteType) / 3;
+  for (uint16_t i = 0; i < entryCount; ++i) {
+    result.entries[i] = Oklab::blend(from.entries[i], to.entries[i], amount);
+  }
+}
+
+// Palette version counter shared by the PaletteRotation variants, with subscriptions for caches that depend on the palette
+class PaletteVersioning {
+public:
+  typedef std::function<void(uint32_t version)> PaletteChangeHandler;
+private:
+  // a list so handlers can subscribe and unsubscribe during a notification without moving the handler that's running.
+  // Unsubscribing mid-notification clears the id, and the entry is erased once every notification has returned
+  std::list<std::pair<unsigned, PaletteChangeHandler> > subscribers;
+  unsigned lastSubscriberID = 0;
+  uint8_t notifyDepth = 0; // > 0 while handlers are running, handlers can change the palette again
+protected:
+  uint32_t version = 0; // bumped whenever the current palette changes
+
+  void paletteChanged() {
+    ++version;
+    uint32_t changedVersion = version;
+    ++notifyDepth;
+    // handlers subscribed during this notification are appended past `count`, so they start with the next change
+    size_t count = subscribers.size();
+    auto it = subscribers.begin();
+    for (size_t i = 0; i < count; ++i, ++it) {
+      if (it->first != 0) {
+        it->second(changedVersion);
+      }
+    }
+    if (--notifyDepth == 0) {
+      subscribers.remove_if([](const std::pair<unsigned, PaletteChangeHandler> &subscriber) { return subscriber.first == 0; });
+    }
+  }
+public:
+  // handler is called after every palette change, including each blend step. Returns an id for unsubscribe.
+  // Handlers may subscribe and unsubscribe, themselves included
+  unsigned subscribe(PaletteChangeHandler handler) {
+    subscribers.emplace_back(++lastSubscriberID, handler);
+    return lastSubscriberID;
+  }
+
+  void unsubscribe(unsigned subscriberID) {
+    for (auto it = subscribers.begin(); it != subscribers.end(); ++it) {
+      if (it->first == subscriberID && subscriberID != 0) {
+        if (notifyDepth > 0) {
+          it->first = 0;
+        } else {
+          subscribers.erase(it);
+        }
+        return;
+      }
+    }
+    assert(false, "no palette subscriber with id %u", subscriberID);
+  }
+};
+
+// scales color to the given luma, saturating channels that would overflow. black stays black
+inline CRGB lumaNormalizedColor(CRGB color, uint8_t luma) {
+  uint8_t oldLuma = color.getLuma();
+  if (oldLuma == 0) {
+    return CRGB::Black;
+  }
+  CRGB normalized;
+  normalized.r = min(0xFF, color.r * luma / oldLuma);
+  normalized.g = min(0xFF, color.g * luma / oldLuma);
+  normalized.b = min(0xFF, color.b * luma / oldLuma);
+  return normalized;
+}
+
 template <typename PaletteType>
-class PaletteRotation {
+class PaletteRotation : public PaletteVersioning {
 private:
   PaletteManager<PaletteType> manager;
   bool doneInit=false;
@@ -333,12 +673,44 @@ private:
 
   unsigned long lastBlendStep = 0;
   unsigned long lastPaletteChange = 0;
+  uint8_t blendProgress = 0; // position between startingPalette and targetPalette when blending in Oklab
+
+  // derived tables, rebuilt lazily when they fall behind version
+  PaletteType lumaNormalizedPalette;
+  uint8_t lumaNormalizedLuma = 0;
+  uint32_t lumaNormalizedVersion = 0;
+  uint8_t lastRequestedLuma = 0; // a luma asked for twice in a row takes over the cache
+  CRGB maxLumaColor = CRGB::Black;
+  uint32_t maxLumaVersion = 0;
+
+  void paletteRotateOklab(int amt) {
+    uint8_t lastProgress = blendProgress;
+    blendProgress = constrain(blendProgress + amt, 0, 0xFF);
+    if (blendProgress != lastProgress) {
+      blendPaletteOklab<PaletteType>(currentPalette, startingPalette, targetPalette, blendProgress);
+      paletteChanged();
+    }
+    if (blendProgress == 0xFF) {
+      // done animating forward, continue from the target toward a new one
+      startingPalette = targetPalette;
+      assignPalette(&targetPalette);
+      blendProgress = 0;
+      lastPaletteChange = millis();
+    } else if (blendProgress == 0 && amt < 0) {
+      // done animating backward, continue from the start toward a new one
+      targetPalette = startingPalette;
+      assignPalette(&startingPalette);
+      blendProgress = 0xFF;
+      lastPaletteChange = millis();
+    }
+  }
 public:
   unsigned int secondsPerPalette = 10;
   uint8_t minBrightness = 0;
   uint8_t maxColorJump = 0xFF;
   bool pauseRotation = false;
-  
+  BlendSpace blendSpace = blendSpaceRGB; // Oklab rotation converts each changing palette entry three times per blend step
+
   PaletteRotation(int minBrightness=0) : minBrightness(minBrightness) { }
   
   virtual void assignPalette(PaletteType* palettePtr) {
@@ -352,12 +724,17 @@ public:
       startingPalette = currentPalette;
       lastPaletteChange = millis();
       doneInit = true;
+      paletteChanged();
     }
   }
 
   void paletteRotate(int amt) {
     initPalettes();
     if (amt == 0) return;
+    if (blendSpace == blendSpaceOklab) {
+      paletteRotateOklab(amt);
+      return;
+    }
     bool changed = false;
     PaletteType &towards = (amt > 0 ? targetPalette : startingPalette);
     if (amt < 0) {
@@ -366,7 +743,9 @@ public:
     for (int i = 0; i < amt; ++i) {
       changed = nblendPaletteTowardPalette<PaletteType>(currentPalette, towards, sizeof(PaletteType) / 3) || changed;
     }
-    if (!changed) {
+    if (changed) {
+      paletteChanged();
+    } else {
       // done animating, choose a new target
       assignPalette(&towards);
       lastPaletteChange = millis();
@@ -379,8 +758,9 @@ public:
       if (amt != 0) {
         paletteRotate(amt);
       } else if (millis() - lastBlendStep > secondsPerPalette*1000/255) {
-        paletteRotate(1);
+        // stamp the step first so change handlers that read the palette don't step again
         lastBlendStep = millis();
+        paletteRotate(1);
       }
     }
   }
@@ -394,15 +774,25 @@ public:
   virtual void setPalette(PaletteType palette) {
     currentPalette = palette;
     startingPalette = currentPalette;
+    blendProgress = 0;
     if (lastPaletteChange == 0) {
       assignPalette(&targetPalette);
     }
     lastPaletteChange = millis();
+    paletteChanged();
   }
 
   void randomizePalette() {
     manager.getRandomPalette(&currentPalette, minBrightness, maxColorJump);
     startingPalette = currentPalette;
+    blendProgress = 0;
+    paletteChanged();
+  }
+
+  // Increases every time the current palette changes, so dependent caches can compare against the version they were built from
+  uint32_t paletteVersion() {
+    paletteRotationTick();
+    return version;
   }
 
   inline CRGB getPaletteColor(PaletteType& palette, uint8_t n, uint8_t brightness=0xFF) {
@@ -414,13 +804,20 @@ public:
   }
 
   CRGB getLumaNormalizedPaletteColor(PaletteType& palette, uint8_t n, uint8_t luma) {
-    CRGB color = getPaletteColor(palette, n);
-    uint8_t oldLuma = color.getLuma();
-    CRGB normalized;
-    normalized.r = 0xFF * color.r * luma / oldLuma / 0xFF;
-    normalized.g = 0xFF * color.g * luma / oldLuma / 0xFF;
-    normalized.b = 0xFF * color.b * luma / oldLuma / 0xFF;
-    return normalized;
+    return lumaNormalizedColor(getPaletteColor(palette, n), luma);
+  }
+
+  // current palette with every entry normalized to luma, cached until the palette or luma changes
+  PaletteType& getLumaNormalizedPalette(uint8_t luma) {
+    PaletteType &palette = getPalette();
+    if (lumaNormalizedVersion != version || lumaNormalizedLuma != luma) {
+      for (uint16_t i = 0; i < sizeof(PaletteType) / 3; ++i) {
+        lumaNormalizedPalette.entries[i] = lumaNormalizedColor(palette.entries[i], luma);
+      }
+      lumaNormalizedLuma = luma;
+      lumaNormalizedVersion = version;
+    }
+    return lumaNormalizedPalette;
   }
 
   CRGB getMaxLumaPaletteColor(PaletteType& palette) {
@@ -436,8 +833,25 @@ public:
     return color;
   }
 
-  inline CRGB getLumaNormalizedPaletteColor(uint8_t n, uint8_t luma) {
-    return getLumaNormalizedPaletteColor(getPalette(), n, luma);
+  // brightest entry of the current palette, cached until the palette changes
+  CRGB getMaxLumaPaletteColor() {
+    PaletteType &palette = getPalette();
+    if (maxLumaVersion != version) {
+      maxLumaColor = getMaxLumaPaletteColor(palette);
+      maxLumaVersion = version;
+    }
+    return maxLumaColor;
+  }
+
+  // The cache holds a single luma, so only a luma repeated from the last call reads from it. Callers whose luma varies
+  // from call to call get each color normalized directly, rather than rebuilding all the entries every time
+  CRGB getLumaNormalizedPaletteColor(uint8_t n, uint8_t luma) {
+    bool cached = (luma == lumaNormalizedLuma || luma == lastRequestedLuma);
+    lastRequestedLuma = luma;
+    if (!cached) {
+      return getLumaNormalizedPaletteColor(getPalette(), n, luma);
+    }
+    return ColorFromPalette(getLumaNormalizedPalette(luma), n);
   }
 
   static CRGB getMirroredPaletteColor(PaletteType& palette, uint16_t n, uint8_t brightness = 0xFF, uint8_t *outColorIndex=NULL) {
@@ -462,4 +876,174 @@ public:
   }
 };
 
+/* -------------------------------------------------------------------- */
+
+// PaletteRotation over keyframe palettes for low-RAM targets. Rotation blends the keyframes directly rather than
+// stepping a 256-entry table, so the whole rotation costs about a tenth of PaletteRotation<CRGBPalette256>.
+// The current palette holds the merged stops of the starting and target palettes.
+template <uint8_t MAX_STOPS>
+class PaletteRotation<KeyframePalette<MAX_STOPS> > : public PaletteVersioning {
+public:
+  typedef KeyframePalette<MAX_STOPS> SourcePalette;
+  typedef KeyframePalette<2 * MAX_STOPS> BlendedPalette;
+private:
+  PaletteManager<SourcePalette> manager;
+  bool doneInit=false;
+  SourcePalette startingPalette;
+  BlendedPalette currentPalette;
+  SourcePalette targetPalette;
+
+  unsigned long lastBlendStep = 0;
+  unsigned long lastPaletteChange = 0;
+  uint8_t blendProgress = 0; // position between startingPalette and targetPalette
+
+  CRGB maxLumaColor = CRGB::Black;
+  uint32_t maxLumaVersion = 0;
+
+  void updateCurrentPalette() {
+    blendKeyframePalettes(currentPalette, startingPalette, targetPalette, blendProgress, blendSpace);
+    paletteChanged();
+  }
+public:
+  unsigned int secondsPerPalette = 10;
+  uint8_t minBrightness = 0;
+  uint8_t maxColorJump = 0xFF;
+  bool pauseRotation = false;
+  BlendSpace blendSpace = blendSpaceRGB; // applies to the stop colors
+
+  PaletteRotation(int minBrightness=0) : minBrightness(minBrightness) { }
+
+  virtual void assignPalette(SourcePalette* palettePtr) {
+    manager.getRandomPalette(palettePtr, minBrightness, maxColorJump);
+  }
+
+  void initPalettes() {
+    if (!doneInit) {
+      assignPalette(&startingPalette);
+      assignPalette(&targetPalette);
+      blendProgress = 0;
+      lastPaletteChange = millis();
+      doneInit = true;
+      updateCurrentPalette();
+    }
+  }
+
+  void paletteRotate(int amt) {
+    initPalettes();
+    if (amt == 0) return;
+    uint8_t lastProgress = blendProgress;
+    blendProgress = constrain(blendProgress + amt, 0, 0xFF);
+    if (blendProgress == 0xFF) {
+      // done animating forward, continue from the target toward a new one
+      startingPalette = targetPalette;
+      assignPalette(&targetPalette);
+      blendProgress = 0;
+      lastPaletteChange = millis();
+    } else if (blendProgress == 0 && amt < 0) {
+      // done animating backward, continue from the start toward a new one
+      targetPalette = startingPalette;
+      assignPalette(&startingPalette);
+      blendProgress = 0xFF;
+      lastPaletteChange = millis();
+    } else if (blendProgress == lastProgress) {
+      return;
+    }
+    updateCurrentPalette();
+  }
+
+  void paletteRotationTick(int amt=0) {
+    initPalettes();
+    if (!pauseRotation) {
+      if (amt != 0) {
+        paletteRotate(amt);
+      } else if (millis() - lastBlendStep > secondsPerPalette*1000/255) {
+        // stamp the step first so change handlers that read the palette don't step again
+        lastBlendStep = millis();
+        paletteRotate(1);
+      }
+    }
+  }
+
+  BlendedPalette& getPalette() {
+    paletteRotationTick();
+    return currentPalette;
+  }
+
+  // unblended override
+  virtual void setPalette(SourcePalette palette) {
+    initPalettes();
+    startingPalette = palette;
+    blendProgress = 0;
+    lastPaletteChange = millis();
+    updateCurrentPalette();
+  }
+
+  void randomizePalette() {
+    initPalettes();
+    manager.getRandomPalette(&startingPalette, minBrightness, maxColorJump);
+    blendProgress = 0;
+    updateCurrentPalette();
+  }
+
+  // Increases every time the current palette changes, so dependent caches can compare against the version they were built from
+  uint32_t paletteVersion() {
+    paletteRotationTick();
+    return version;
+  }
+
+  template <uint8_t STOPS>
+  inline CRGB getPaletteColor(KeyframePalette<STOPS>& palette, uint8_t n, uint8_t brightness=0xFF) {
+    return ColorFromPalette(palette, n, brightness);
+  }
+
+  inline CRGB getPaletteColor(uint8_t n, uint8_t brightness = 0xFF) {
+    return getPaletteColor(getPalette(), n, brightness);
+  }
+
+  // not cached: normalizing the stops would not normalize the colors interpolated between them
+  inline CRGB getLumaNormalizedPaletteColor(uint8_t n, uint8_t luma) {
+    return lumaNormalizedColor(getPaletteColor(n), luma);
+  }
+
+  // luma is linear between stops, so the brightest color is always a stop
+  CRGB getMaxLumaPaletteColor() {
+    BlendedPalette &palette = getPalette();
+    if (maxLumaVersion != version) {
+      uint8_t maxLuma = 0;
+      maxLumaColor = CRGB::Black;
+      for (uint8_t i = 0; i < palette.count; ++i) {
+        uint8_t luma = palette.colors[i].getLuma();
+        if (luma > maxLuma) {
+          maxLuma = luma;
+          maxLumaColor = palette.colors[i];
+        }
+      }
+      maxLumaVersion = version;
+    }
+    return maxLumaColor;
+  }
+
+  template <uint8_t STOPS>
+  static CRGB getMirroredPaletteColor(KeyframePalette<STOPS>& palette, uint16_t n, uint8_t brightness = 0xFF, uint8_t *outColorIndex=NULL) {
+    n = n % 0x200;
+    if (n >= 0x100) {
+      n = 0x200 - n - 1;
+    }
+    if (outColorIndex) {
+      *outColorIndex = n;
+    }
+    return ColorFromPalette(palette, n, brightness);
+  }
+
+  inline CRGB getMirroredPaletteColor(uint16_t n, uint8_t brightness = 0xFF, uint8_t *outColorIndex=NULL) {
+    return getMirroredPaletteColor(getPalette(), n, brightness, outColorIndex);
+  }
+
+  CRGB getShiftingPaletteColor(uint16_t phase, int speed=2/*cycles per minute*/, uint8_t brightness = 0xFF, bool mirrored=true) {
+    BlendedPalette& palette = getPalette();
+    uint16_t index = phase + 0xFF * speed * millis() / 1000 / 60;
+    return (mirrored ? getMirroredPaletteColor(palette, index, brightness) : getPaletteColor(palette, index, brightness));
+  }
+};
+
 #endif
@@ -3,134 +3,71 @@
 
 #include <FastLED.h>
 #include <vector>
-#include <set>
+#include <memory>
 #include <functional>
-#include <optional>
 
 #include <drawing.h>
 #include <mapping.h>
 #include <paletting.h>
 #include <util.h>
 
+#if defined(ARDUINO_ARCH_RP2040)
+#include <pico/multicore.h>
+#elif !defined(ARDUINO)
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
 // a lil patternlet to run a particle simulation on an adjacency graph
-// supports max 255 particles for now
+// the ParticleIndex template parameter sets the particle limit: uint8_t supports 255 particles, uint16_t supports 65535
 
-template <int SIZE>
+template <int SIZE, typename ParticleIndex, typename Hooks>
 class ParticleSim;
+template <typename ParticleIndex>
+struct ParticleSpan;
 
-  // note: suboptimal packing when PixelIndex is 2 bytes
-  // TODO: Particle needs to be specialized / reduced features to be backported to 32KB ram chips e.g. samd21g
+// A view of one particle in a ParticlePool. Fields are references into the pool's arrays, so writes go straight to the pool.
+// Views are cheap to make but are invalidated when the particle they point at moves, i.e. when another particle is removed,
+// or when the pool grows.
+// addParticle(), particles[i] and iterating particles return views by value. Code that took a Particle & from them, as when
+// particles were a std::vector<Particle>, no longer compiles: take `Particle p = sim.addParticle();`, `auto p = sim.particles[i];`
+// or `for (Particle p : sim.particles)` instead. Writes through p still change the particle.
 struct Particle {
-  template <int SIZE>
+  template <int SIZE, typename ParticleIndex, typename Hooks>
   friend class ParticleSim;
 private:
-  unsigned long birthmilli;
-  unsigned long lastMove = 0; // when px was updated
+  unsigned long &birthmilli;
+  unsigned particleHandle;
 public:
-  PixelIndex lastPx;
-  PixelIndex px; // current particle position (or start of fadeup-chain)
+  PixelIndex &lastPx;
+  PixelIndex &px; // current particle position (or start of fadeup-chain)
 
-  uint8_t brightness = 0xFF;
-  uint8_t speed = 0; // pixels/second
+  uint8_t &brightness;
+  uint8_t &speed; // pixels/second
 
-  CRGB color;
-  uint8_t colorIndex; // storage only
-  
-  unsigned long lifespan;
-  EdgeTypesQuad directions; // quad allows four priority levels
+  CRGB &color;
+  uint8_t &colorIndex; // storage only
 
-protected:
-  std::optional<PixelIndex> continueToPx; // stash for when particle is planning to move to a continueTo=true Edge
-  bool alive = true; // when a particle dies, its fadeup trail still needs to be completed so we cannot remove it immediately
-  uint8_t fadeUpDistance = 0;
-  std::optional<PixelIndex> *fadeHistory = NULL; // when fading up, particle.px tracks the start of the fade chain, fadeHistory tracks pixels that have not yet reached full brightness
-public:
+  unsigned long &lifespan;
+  EdgeTypesQuad &directions; // quad allows four priority levels
 
-  Particle(int px, EdgeTypesQuad directions, unsigned long lifespan) 
-    : px(px), directions(directions), lifespan(lifespan) {
-    reset();
-  }
+  template <typename Pool>
+  Particle(Pool &pool, typename Pool::ParticleIndex index) :
+    birthmilli(pool.birthmilli[index]),
+    particleHandle(pool.handle(index)),
+    lastPx(pool.lastPx[index]),
+    px(pool.px[index]),
+    brightness(pool.brightness[index]),
+    speed(pool.speed[index]),
+    color(pool.color[index]),
+    colorIndex(pool.colorIndex[index]),
+    lifespan(pool.lifespan[index]),
+    directions(pool.directions[index]) { }
 
-  ~Particle() noexcept {
-    delete [] fadeHistory;
-  }
-
-  Particle(const Particle &other) noexcept :
-    birthmilli(other.birthmilli),
-    lifespan(other.lifespan),
-    alive(other.alive),
-    color(other.color),
-    colorIndex(other.colorIndex),
-    px(other.px),
-    lastPx(other.lastPx),
-    continueToPx(other.continueToPx),
-    directions(other.directions),
-    brightness(other.brightness),
-    speed(other.speed),
-    lastMove(other.lastMove),
-    fadeUpDistance(other.fadeUpDistance) {
-      if (this != &other) {
-        fadeHistory = new std::optional<PixelIndex>[fadeUpDistance];
-        for (int i = 0; i < fadeUpDistance; ++i) {
-          fadeHistory[i] = other.fadeHistory[i];
-        }
-      }
-  }
-
-  Particle(Particle &&other) noexcept {
-    *this = std::move(other);
-  }
-
-  Particle &operator=(Particle &&other) noexcept {
-    if (this != &other) {
-      birthmilli = other.birthmilli;
-      lifespan = other.lifespan;
-      alive = other.alive;
-      
-      color = other.color;
-      colorIndex = other.colorIndex;
-      brightness = other.brightness;
-      speed = other.speed;
-      lastMove = other.lastMove,
-
-      px = other.px;
-      lastPx = other.lastPx;
-      continueToPx = other.continueToPx;
-      directions = other.directions;
-
-      fadeUpDistance = other.fadeUpDistance;
-      delete [] fadeHistory;
-      fadeHistory = other.fadeHistory;
-      other.fadeHistory = NULL;
-    }
-    return *this;
-  }
-
-  Particle &operator=(const Particle &other) {
-    if (this == &other) return *this;
-
-    birthmilli = other.birthmilli;
-    lifespan = other.lifespan;
-    alive = other.alive;
-    
-    color = other.color;
-    colorIndex = other.colorIndex;
-    brightness = other.brightness;
-    speed = other.speed;
-    lastMove = other.lastMove,
-
-    px = other.px;
-    lastPx = other.lastPx;
-    continueToPx = other.continueToPx;
-    directions = other.directions;
-
-    fadeUpDistance = other.fadeUpDistance;
-    delete [] fadeHistory;
-    fadeHistory = new std::optional<PixelIndex>[fadeUpDistance];
-    for (int d = 0; d < fadeUpDistance; ++d) {
-      fadeHistory[d] = other.fadeHistory[d];
-    }
-    return *this;
+  // stable id of this particle in its pool, see ParticlePool::at
+  unsigned handle() const {
+    return particleHandle;
   }
 
   void reset() {
@@ -138,23 +75,6 @@ public:
     color = CHSV(random8(), 0xFF, 0xFF);
   }
 
-  void clearFadeHistory() {
-    for (unsigned i = 0; i < fadeUpDistance; ++i) {
-      fadeHistory[i] = std::nullopt;
-    }
-  }
-
-  void setFadeUpDistance(unsigned distance) {
-    fadeUpDistance = distance;
-    delete [] fadeHistory;
-    if (distance > 0) {
-      fadeHistory = new std::optional<PixelIndex>[distance];
-      clearFadeHistory();
-    } else {
-      fadeHistory = NULL;
-    }
-  }
-
   // Bit age, capped at lifespan
   unsigned long age() {
     return min(millis() - birthmilli, lifespan ?: millis() - birthmilli);
@@ -172,22 +92,676 @@ protected:
   }
 };
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Fixed-capacity structure-of-arrays particle storage. All memory is allocated up front, so nothing allocates per frame.
+// Live particles are dense in [0, size()); removal swaps the last particle into the hole, so use handles to track a particle across removals.
+// Memory per particle of capacity on 32-bit targets: 21 + 4 * sizeof(PixelIndex) + 2 * sizeof(ParticleIndex) bytes, i.e. 27 with
+// 8-bit pixel and particle indexes, plus 2 + fadeUpDistance * sizeof(PixelIndex) for fade-up trails. The 21 is birthmilli 4,
+// moveProgress 2, lifespan 4, directions 4, color 3 and brightness, speed, colorIndex and flags 1 each
+template <typename ParticleIndexType>
+class ParticlePool {
+  template <int SIZE, typename ParticleIndex, typename Hooks>
+  friend class ParticleSim;
+  friend struct Particle;
+public:
+  typedef ParticleIndexType ParticleIndex;  // dense position of a live particle, changes when other particles are removed
+  typedef ParticleIndexType ParticleHandle; // stable id of a live particle, valid until that particle is erased
+
+  enum : uint8_t {
+    aliveFlag      = 1 << 0, // when a particle dies, its fadeup trail still needs to be completed so we cannot remove it immediately
+    continueToFlag = 1 << 1, // continueToPx holds a stashed continueTo=true Edge target
+    nextPxFlag     = 1 << 2, // nextPx holds the already-chosen next hop
+    flowingFlag    = 1 << 3, // free to flow: drawn at least once, or spawned by the simulation itself
+  };
+private:
+  ParticleIndex capacity_;
+  ParticleIndex count = 0;
+
+  unsigned long *birthmilli;
+  uint16_t *moveProgress; // toward the next move, in ms * pixels/second. Moves at 1000
+  unsigned long *lifespan;
+  EdgeTypesQuad *directions;
+  CRGB *color;
+  PixelIndex *px;
+  PixelIndex *lastPx;
+  PixelIndex *continueToPx; // stash for when particle is planning to move to a continueTo=true Edge
+  PixelIndex *nextPx; // where the particle moves next, chosen ahead of time for interpolated drawing
+  uint8_t *brightness;
+  uint8_t *speed;
+  uint8_t *colorIndex;
+  uint8_t *flags;
+
+  // sparse set: handles[dense index] is that particle's handle, and past count it parks the free handles
+  ParticleHandle *handles;
+  ParticleIndex *handleIndexes; // handle -> dense index
+
+  // when fading up, px tracks the start of the fade chain, fadeHistory tracks pixels that have not yet reached full brightness.
+  // Each particle owns a ring of fadeUpDistance entries, newest at fadeHead, so moving is O(1)
+  uint8_t fadeUpDistance = 0;
+  PixelIndex *fadeHistory = NULL;
+  uint8_t *fadeHead = NULL;
+  uint8_t *fadeLength = NULL;
+
+  void copyParticle(ParticleIndex to, ParticleIndex from, bool copyFadeHistory=true) {
+    birthmilli[to] = birthmilli[from];
+    moveProgress[to] = moveProgress[from];
+    lifespan[to] = lifespan[from];
+    directions[to] = directions[from];
+    color[to] = color[from];
+    px[to] = px[from];
+    lastPx[to] = lastPx[from];
+    continueToPx[to] = continueToPx[from];
+    nextPx[to] = nextPx[from];
+    brightness[to] = brightness[from];
+    speed[to] = speed[from];
+    colorIndex[to] = colorIndex[from];
+    flags[to] = flags[from];
+    if (fadeUpDistance > 0 && copyFadeHistory) {
+      // copy only the live part of the ring, unrolled so the newest entry lands at 0
+      for (uint8_t d = 0; d < fadeLength[from]; ++d) {
+        fadeHistory[to * fadeUpDistance + d] = fadeHistoryAt(from, d);
+      }
+      fadeHead[to] = 0;
+      fadeLength[to] = fadeLength[from];
+    }
+  }
+
+  // reallocates array to size entries, keeping the first `keep`. New entries are value-initialized
+  template <typename T>
+  static void regrow(T *&array, unsigned keep, unsigned size) {
+    T *grown = new T[size]();
+    for (unsigned i = 0; i < keep; ++i) {
+      grown[i] = array[i];
+    }
+    delete [] array;
+    array = grown;
+  }
+
+  ParticleIndex push() {
+    ParticleIndex index = count++;
+    handleIndexes[handles[index]] = index;
+    clearFadeHistory(index);
+    return index;
+  }
+
+public:
+  ParticlePool(ParticleIndex capacity) : capacity_(capacity) {
+    birthmilli = new unsigned long[capacity];
+    moveProgress = new uint16_t[capacity];
+    lifespan = new unsigned long[capacity];
+    directions = new EdgeTypesQuad[capacity];
+    color = new CRGB[capacity];
+    px = new PixelIndex[capacity];
+    lastPx = new PixelIndex[capacity];
+    continueToPx = new PixelIndex[capacity];
+    nextPx = new PixelIndex[capacity];
+    brightness = new uint8_t[capacity];
+    speed = new uint8_t[capacity];
+    colorIndex = new uint8_t[capacity];
+    flags = new uint8_t[capacity];
+    handles = new ParticleHandle[capacity];
+    handleIndexes = new ParticleIndex[capacity];
+    for (unsigned i = 0; i < capacity; ++i) {
+      handles[i] = i;
+    }
+  }
+
+  ~ParticlePool() {
+    delete [] birthmilli;
+    delete [] moveProgress;
+    delete [] lifespan;
+    delete [] directions;
+    delete [] color;
+    delete [] px;
+    delete [] lastPx;
+    delete [] continueToPx;
+    delete [] nextPx;
+    delete [] brightness;
+    delete [] speed;
+    delete [] colorIndex;
+    delete [] flags;
+    delete [] handles;
+    delete [] handleIndexes;
+    delete [] fadeHistory;
+    delete [] fadeHead;
+    delete [] fadeLength;
+  }
+
+  ParticlePool(const ParticlePool &) = delete;
+  ParticlePool &operator=(const ParticlePool &) = delete;
+
+  inline ParticleIndex size() const { return count; }
+  inline ParticleIndex capacity() const { return capacity_; }
+  inline bool full() const { return count == capacity_; }
+
+  inline Particle operator[](ParticleIndex index) {
+    return Particle(*this, index);
+  }
+
+  inline ParticleHandle handle(ParticleIndex index) const {
+    return handles[index];
+  }
+
+  inline ParticleIndex indexOf(ParticleHandle handle) const {
+    return handleIndexes[handle];
+  }
+
+  inline Particle at(ParticleHandle handle) {
+    return Particle(*this, handleIndexes[handle]);
+  }
+
+  inline bool alive(ParticleIndex index) const {
+    return flags[index] & aliveFlag;
+  }
+
+  ParticleIndex add(PixelIndex pixel, EdgeTypesQuad particleDirections, unsigned long particleLifespan) {
+    assert(!full(), "ParticlePool is full");
+    ParticleIndex index = push();
+    birthmilli[index] = millis();
+    moveProgress[index] = 0;
+    lifespan[index] = particleLifespan;
+    directions[index] = particleDirections;
+    color[index] = CHSV(random8(), 0xFF, 0xFF);
+    px[index] = pixel;
+    lastPx[index] = pixel;
+    continueToPx[index] = 0;
+    nextPx[index] = pixel;
+    brightness[index] = 0xFF;
+    speed[index] = 0;
+    colorIndex[index] = 0;
+    flags[index] = aliveFlag;
+    return index;
+  }
+
+  ParticleIndex addCopy(ParticleIndex from) {
+    assert(!full(), "ParticlePool is full");
+    ParticleIndex index = push();
+    copyParticle(index, from, false); // copies start with an empty trail
+    flags[index] &= ~nextPxFlag; // and are usually moved somewhere else
+    return index;
+  }
+
+  // swap-remove: the last particle moves into index
+  void remove(ParticleIndex index) {
+    ParticleIndex last = count - 1;
+    if (index != last) {
+      copyParticle(index, last);
+      ParticleHandle removed = handles[index];
+      handles[index] = handles[last];
+      handles[last] = removed;
+      handleIndexes[handles[index]] = index;
+    }
+    --count;
+  }
+
+  void clear() {
+    count = 0;
+  }
+
+  void clearFadeHistory(ParticleIndex index) {
+    if (fadeUpDistance > 0) {
+      fadeLength[index] = 0;
+    }
+  }
+
+  // records pixel as the newest history entry, dropping the oldest once the ring is full
+  inline void pushFadeHistory(ParticleIndex index, PixelIndex pixel) {
+    uint8_t head = (fadeHead[index] == 0 ? fadeUpDistance : fadeHead[index]) - 1;
+    fadeHistory[index * fadeUpDistance + head] = pixel;
+    fadeHead[index] = head;
+    if (fadeLength[index] < fadeUpDistance) {
+      ++fadeLength[index];
+    }
+  }
+
+  // d-th newest history entry, d < fadeLength
+  inline PixelIndex fadeHistoryAt(ParticleIndex index, uint8_t d) const {
+    uint8_t slot = fadeHead[index] + d;
+    if (slot >= fadeUpDistance) {
+      slot -= fadeUpDistance;
+    }
+    return fadeHistory[index * fadeUpDistance + slot];
+  }
+
+  // Grows the pool to hold `capacity` particles, keeping the ones it has. This allocates and invalidates Particle views and spans,
+  // so it's best done up front
+  void reserve(ParticleIndex capacity) {
+    if (capacity <= capacity_) {
+      return;
+    }
+    regrow(birthmilli, count, capacity);
+    regrow(moveProgress, count, capacity);
+    regrow(lifespan, count, capacity);
+    regrow(directions, count, capacity);
+    regrow(color, count, capacity);
+    regrow(px, count, capacity);
+    regrow(lastPx, count, capacity);
+    regrow(continueToPx, count, capacity);
+    regrow(nextPx, count, capacity);
+    regrow(brightness, count, capacity);
+    regrow(speed, count, capacity);
+    regrow(colorIndex, count, capacity);
+    regrow(flags, count, capacity);
+    // every handle is in use or parked, so keep them all and park the new ones
+    regrow(handles, capacity_, capacity);
+    regrow(handleIndexes, capacity_, capacity);
+    for (unsigned i = capacity_; i < capacity; ++i) {
+      handles[i] = i;
+    }
+    if (fadeUpDistance > 0) {
+      regrow(fadeHistory, count * fadeUpDistance, capacity * fadeUpDistance);
+      regrow(fadeHead, count, capacity);
+      regrow(fadeLength, count, capacity);
+    }
+    capacity_ = capacity;
+  }
+
+  // reallocates the fade-up history and clears it, configuration-time only
+  void setFadeUpDistance(uint8_t distance) {
+    delete [] fadeHistory;
+    delete [] fadeHead;
+    delete [] fadeLength;
+    fadeHistory = (distance > 0 ? new PixelIndex[capacity_ * distance] : NULL);
+    fadeHead = (distance > 0 ? new uint8_t[capacity_]() : NULL);
+    fadeLength = (distance > 0 ? new uint8_t[capacity_]() : NULL);
+    fadeUpDistance = distance;
+  }
+
+  class iterator {
+    ParticlePool &pool;
+    ParticleIndex index;
+  public:
+    iterator(ParticlePool &pool, ParticleIndex index) : pool(pool), index(index) { }
+    Particle operator*() { return pool[index]; }
+    iterator &operator++() { ++index; return *this; }
+    bool operator!=(const iterator &other) const { return index != other.index; }
+  };
+
+  iterator begin() { return iterator(*this, 0); }
+  iterator end() { return iterator(*this, count); }
+
+  ParticleSpan<ParticleIndex> span();
+};
+
+// Every particle in a pool as parallel arrays, for hooks that handle all particles in one loop.
+// Includes dead particles that are finishing their fade, check alive(i).
+template <typename ParticleIndexType>
+struct ParticleSpan {
+  typedef ParticleIndexType ParticleIndex;
+
+  const ParticleIndex *count; // the pool's, so particles added or removed during a hook are seen
+  unsigned long *birthmilli;
+  unsigned long *lifespan;
+  EdgeTypesQuad *directions;
+  CRGB *color;
+  PixelIndex *px;
+  PixelIndex *lastPx;
+  uint8_t *brightness;
+  uint8_t *speed;
+  uint8_t *colorIndex;
+  const uint8_t *flags;
+  const ParticleIndex *handles;
+
+  inline ParticleIndex size() const { return *count; }
+  inline bool alive(ParticleIndex index) const { return flags[index] & ParticlePool<ParticleIndex>::aliveFlag; }
+  inline ParticleIndex handle(ParticleIndex index) const { return handles[index]; }
+  inline Particle operator[](ParticleIndex index) { return Particle(*this, index); }
+};
+
+template <typename ParticleIndex>
+ParticleSpan<ParticleIndex> ParticlePool<ParticleIndex>::span() {
+  return {&count, birthmilli, lifespan, directions, color, px, lastPx, brightness, speed, colorIndex, flags, handles};
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// ParticleSim hooks. The sim inherits from its Hooks type and calls these by name, so a Hooks type can be any class
+// with these five methods: derive from ParticleHooks and hide the ones you need. The calls are static and inline,
+// and onUpdateParticles gets all particles at once so per-particle work can be a plain loop over arrays.
+template <typename ParticleIndex>
+struct ParticleHooks {
+  inline void onNewParticle(Particle &) { }     // called upon particle creation
+  inline void onKillParticle(Particle &) { }    // called upon particle death
+  inline void onUpdateParticles(ParticleSpan<ParticleIndex> &) { } // called once per frame
+  inline void onTrail(Particle &, CRGB &, uint16_t &) { } // (particle, trailColor, trailFadeDown), see ParticleSim::trailField
+  inline void onCollision(Particle &, Particle &) { } // (mover, occupant), see ParticleSim::collisionRule
+};
+
+// The default hooks: std::functions that can be set at runtime
+template <typename ParticleIndex>
+struct ParticleCallbacks {
+  std::function<void(Particle &)> handleNewParticle = [](Particle &){};                            // called upon particle creation
+  std::function<void(Particle &, ParticleIndex)> handleUpdateParticle = [](Particle &, ParticleIndex){}; // called once per frame per live particle
+  std::function<void(Particle &)> handleKillParticle = [](Particle &){};                           // called upon particle death
+  // with a trailField, called once per frame per drawn particle to pick the trail color and fadeDown it leaves behind. Defaults to its own color and fadeDown
+  std::function<void(Particle &, CRGB &, uint16_t &)> handleTrail = [](Particle &, CRGB &, uint16_t &){};
+  // called when a particle moves onto a pixel where a live particle already is, before collisionRule is applied
+  std::function<void(Particle &, Particle &)> handleCollision = [](Particle &, Particle &){};
+
+  void onNewParticle(Particle &particle) {
+    handleNewParticle(particle);
+  }
+
+  void onKillParticle(Particle &particle) {
+    handleKillParticle(particle);
+  }
+
+  void onUpdateParticles(ParticleSpan<ParticleIndex> &particles) {
+    ParticleIndex i = 0;
+    for (ParticleIndex index = 0; index < particles.size(); ++index) {
+      if (particles.alive(index)) {
+        Particle p = particles[index];
+        handleUpdateParticle(p, i++);
+      }
+    }
+  }
+
+  void onTrail(Particle &particle, CRGB &trailColor, uint16_t &trailFadeDown) {
+    handleTrail(particle, trailColor, trailFadeDown);
+  }
+
+  void onCollision(Particle &mover, Particle &occupant) {
+    handleCollision(mover, occupant);
+  }
+};
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Trails that fade per pixel. Only the pixels in the field are decayed and redrawn each frame, so the cost follows
+// how much is lit rather than the size of the layer, and each pixel can have its own color and decay rate.
+// The field owns its layer: anything else drawn into it won't fade.
+// Memory: 2 * sizeof(PixelIndex) per pixel of SIZE plus 7 + sizeof(PixelIndex) per pixel of capacity.
+template <int SIZE>
+class TrailField {
+  static constexpr PixelIndex noSlot = (PixelIndex)~0;
+
+  PixelStorage<SIZE> &ctx;
+  const PixelIndex capacity_;
+  PixelIndex count = 0;
+  PixelIndex *pixels;
+  CRGB *colors;
+  uint16_t *brightness; // 8.8 so slow decays don't stall on rounding
+  uint16_t *fadeDowns; // fadeToBlackBy units per 1/256 millisecond, as ParticleSim::fadeDown
+  PixelIndex slots[SIZE]; // pixel -> slot, or noSlot if the pixel is dark
+  unsigned long lastTick = 0;
+
+  void remove(PixelIndex slot) {
+    ctx.point(pixels[slot], CRGB::Black);
+    slots[pixels[slot]] = noSlot;
+    PixelIndex last = --count;
+    if (slot != last) {
+      pixels[slot] = pixels[last];
+      colors[slot] = colors[last];
+      brightness[slot] = brightness[last];
+      fadeDowns[slot] = fadeDowns[last];
+      slots[pixels[slot]] = slot;
+    }
+  }
+
+public:
+  TrailField(PixelStorage<SIZE> &ctx, PixelIndex capacity=SIZE) : ctx(ctx), capacity_(capacity) {
+    pixels = new PixelIndex[capacity];
+    colors = new CRGB[capacity];
+    brightness = new uint16_t[capacity];
+    fadeDowns = new uint16_t[capacity];
+    for (unsigned i = 0; i < SIZE; ++i) {
+      slots[i] = noSlot;
+    }
+  }
+
+  ~TrailField() {
+    delete [] pixels;
+    delete [] colors;
+    delete [] brightness;
+    delete [] fadeDowns;
+  }
+
+  TrailField(const TrailField &) = delete;
+  TrailField &operator=(const TrailField &) = delete;
+
+  inline PixelIndex size() const { return count; }
+
+  // Leaves color at pixel to fade from `amount` brightness. Brighter than what's already there replaces it, dimmer is ignored.
+  // When the field is full, the dimmest pixel makes room.
+  void deposit(PixelIndex pixel, CRGB color, uint8_t amount, uint16_t fadeDown) {
+    if (amount == 0 || pixel >= SIZE) {
+      return;
+    }
+    PixelIndex slot = slots[pixel];
+    if (slot == noSlot) {
+      if (count == capacity_) {
+        PixelIndex dimmest = 0;
+        for (PixelIndex i = 1; i < count; ++i) {
+          if (brightness[i] < brightness[dimmest]) {
+            dimmest = i;
+          }
+        }
+        if (brightness[dimmest] >> 8 >= amount) {
+          return;
+        }
+        remove(dimmest);
+      }
+      slot = count++;
+      pixels[slot] = pixel;
+      slots[pixel] = slot;
+    } else if (brightness[slot] >> 8 > amount) {
+      return;
+    }
+    colors[slot] = color;
+    brightness[slot] = amount << 8 | 0xFF;
+    fadeDowns[slot] = fadeDown;
+  }
+
+  // decays every pixel in the field by the time since the last update and redraws it, darkening pixels that have faded out
+  void update() {
+    unsigned long mils = millis();
+    unsigned long elapsed = (lastTick ? mils - lastTick : 0);
+    lastTick = mils;
+    for (int slot = count - 1; slot >= 0; --slot) {
+      // fadeToBlackBy(x) scales by (256 - x) / 256, here with x in 8.8
+      uint32_t fade = min((uint32_t)0x10000, (uint32_t)(fadeDowns[slot] * elapsed));
+      brightness[slot] = (uint32_t)brightness[slot] * (0x10000 - fade) >> 16;
+      if (brightness[slot] < 0x100) {
+        remove(slot);
+      } else {
+        ctx.point(pixels[slot], colors[slot], blendSourceOver, brightness[slot] >> 8);
+      }
+    }
+  }
+
+  void clear() {
+    while (count > 0) {
+      remove(count - 1);
+    }
+  }
+};
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// A particle source for ParticleSim::emitters. Spawns `rate` particles per second while enabled, plus bursts.
+// New particles start at px, or anywhere in pixels if set, and each starting value is picked evenly from its range.
+// Attach an emitter to one sim at a time.
+struct ParticleEmitter {
+  template <int SIZE, typename ParticleIndex, typename Hooks>
+  friend class ParticleSim;
+
+  PixelIndex px = 0;
+  const PixelSet *pixels = NULL;
+
+  unsigned rate = 0; // particles/second, 0 for bursts only
+  unsigned burstCount = 0; // how many particles burst() spawns
+  bool enabled = true; // pauses rate spawning, bursts still go
+
+  uint8_t minSpeed = 0, maxSpeed = 0; // pixels/second
+  unsigned long minLifespan = 0, maxLifespan = 0; // in milliseconds, forever if 0
+  uint8_t minBrightness = 0xFF, maxBrightness = 0xFF;
+  uint8_t minColorIndex = 0, maxColorIndex = 0xFF;
+  ColorManager *colorManager = NULL; // colors come from colorIndex on this palette, otherwise they're a random hue
+  std::vector<EdgeTypesQuad> directions; // one is picked per particle, the sim's flowDirections if empty
+
+  // queues burstCount particles (or count) for the sim's next step, where they spawn in one batch
+  void burst() {
+    pendingBurst += burstCount;
+  }
+  void burst(unsigned count) {
+    pendingBurst += count;
+  }
+
+private:
+  unsigned pendingBurst = 0;
+  uint32_t rateCredit = 0; // particle-milliseconds toward the next spawn, one particle per 1000
+};
+
+// Runs ParticleSim's per-particle decisions over ranges of particles in parallel, see ParticleSim::workers.
+// run() splits [0, count) into ranges, calls work(begin, end) on each, and returns once all of them are done.
+class ParticleWorkers {
+public:
+  virtual ~ParticleWorkers() { }
+  virtual void run(unsigned count, const std::function<void(unsigned begin, unsigned end)> &work) = 0;
+};
+
+// everything on the calling core. Same results as any other ParticleWorkers, handy for comparing
+class SerialParticleWorkers : public ParticleWorkers {
+public:
+  void run(unsigned count, const std::function<void(unsigned begin, unsigned end)> &work) {
+    work(0, count);
+  }
+};
+
+#if defined(ARDUINO_ARCH_RP2040)
+// Splits the work between core 0 and core 1. This takes over core 1, so don't also use setup1()/loop1().
+// Only make one.
+class Core1ParticleWorkers : public ParticleWorkers {
+  static inline const std::function<void(unsigned, unsigned)> *work = NULL;
+  static inline volatile unsigned begin1 = 0, end1 = 0;
+  static inline volatile uint32_t requested = 0, completed = 0;
+
+  static void core1Main() {
+    uint32_t seen = 0;
+    while (true) {
+      while (requested == seen) {
+        __wfe();
+      }
+      seen = requested;
+      __dmb();
+      (*work)(begin1, end1);
+      __dmb();
+      completed = seen;
+      __sev();
+    }
+  }
+public:
+  Core1ParticleWorkers() {
+    multicore_launch_core1(core1Main);
+  }
+
+  void run(unsigned count, const std::function<void(unsigned begin, unsigned end)> &work) {
+    unsigned half = count / 2;
+    Core1ParticleWorkers::work = &work;
+    begin1 = half;
+    end1 = count;
+    __dmb();
+    uint32_t request = requested + 1;
+    requested = request;
+    __sev();
+    work(0, half);
+    while (completed != request) {
+      __wfe();
+    }
+    __dmb();
+  }
+};
+#elif !defined(ARDUINO)
+// Host builds (simulators, tests): a pool of threads kept around between runs. The calling thread takes a share too.
+class ThreadParticleWorkers : public ParticleWorkers {
+  const unsigned threadCount; // including the caller
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake, finished;
+  const std::function<void(unsigned, unsigned)> *work = NULL;
+  unsigned count = 0;
+  unsigned generation = 0;
+  unsigned pending = 0;
+  bool stopping = false;
+
+  void threadMain(unsigned share) {
+    unsigned seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = generation;
+      unsigned begin = count * share / threadCount, end = count * (share + 1) / threadCount;
+      lock.unlock();
+      (*work)(begin, end);
+      lock.lock();
+      if (--pending == 0) {
+        finished.notify_one();
+      }
+    }
+  }
+public:
+  ThreadParticleWorkers(unsigned threadCount=std::thread::hardware_concurrency()) : threadCount(threadCount ?: 1) {
+    for (unsigned share = 1; share < this->threadCount; ++share) {
+      threads.emplace_back(&ThreadParticleWorkers::threadMain, this, share);
+    }
+  }
+
+  ~ThreadParticleWorkers() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+  }
+
+  void run(unsigned count, const std::function<void(unsigned begin, unsigned end)> &work) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      this->work = &work;
+      this->count = count;
+      pending = threads.size();
+      ++generation;
+    }
+    wake.notify_all();
+    work(0, count / threadCount);
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&] { return pending == 0; });
+  }
+};
+#endif
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-template <int SIZE> // SIZE is number of pixels
-class ParticleSim {
+template <int SIZE, typename ParticleIndex=uint8_t, typename Hooks=ParticleCallbacks<ParticleIndex> > // SIZE is number of pixels
+class ParticleSim : public Hooks {
 public:
-  typedef enum : uint8_t { random, priority, split } FlowRule;
+  typedef ParticleIndex ParticleHandle;
+
+  typedef enum : uint8_t { random, priority, split, weighted } FlowRule; // weighted is random by Edge.weight
   typedef enum : uint8_t { maintainPopulation, manualSpawn } SpawnRule;
+  // what happens when a particle moves onto a pixel where a live particle already is. Anything but noCollisions keeps an
+  // occupancy index (see particleAt) and calls the collision hook.
+  //   passThrough: nothing more
+  //   bounce:      the mover stays put and both particles turn around
+  //   merge:       the mover is absorbed, adding its brightness and blending its color into the occupant
+  //   annihilate:  both die
+  typedef enum : uint8_t { noCollisions, passThrough, bounce, merge, annihilate } CollisionRule;
 
   bool preventReverseFlow = false; // if true, prevent particles from naturally flowing A->B->A
+  bool interpolateMotion = false;  // draw particles partway to their next hop between moves, for smooth motion at low speeds. Not used with fade-up
   bool followContinueTo = false;   // enable following Edges with continueTo=true when in priority mode
   bool requireExactEdgeTypeMatch = false; // require `Particle.directions == (Edge.types & Particle.directions)` rather than `Particle.direcitons & Edge.types`
 
-  std::vector<Particle> particles;
-  uint8_t maxSpawnPopulation; // number of particles to spawn when spawnRule is maintainPopulation
-  uint8_t maxSpawnPerSecond; // limit how fast new particles are spawned, 0 = no limit (defaults to 1000 * maxSpawnPopulation / lifespan)
+  ParticleIndex maxSpawnPopulation; // number of particles to spawn when spawnRule is maintainPopulation
+  ParticlePool<ParticleIndex> particles;
+  unsigned maxSpawnPerSecond; // limit how fast new particles are spawned, 0 = no limit (defaults to 1000 * maxSpawnPopulation / lifespan)
   uint8_t startingSpeed; // for new particles ; pixels/second
   std::vector<EdgeTypesQuad> flowDirections; // for new particles. quad allows four priority levels
 
@@ -195,66 +769,196 @@ public:
 
   FlowRule flowRule = random;
   SpawnRule spawnRule = maintainPopulation;
+  CollisionRule collisionRule = noCollisions; // particles that split on a move don't collide on that move
 
   EdgeTypes splitDirections = Edge::all; // if flowRule is split, which directions are allowed to split
-  
-  const std::vector<PixelIndex> *spawnPixels = NULL; // list of pixels to automatically spawn particles on
-  const std::set<PixelIndex> *allowedPixels = NULL; // set of pixels that particles are allowed to travel to
-
-  std::function<void(Particle &)> handleNewParticle = [](Particle &particle){};                               // called upon particle creation
-  std::function<void(Particle &, uint8_t)> handleUpdateParticle = [](Particle &particle, uint8_t index){}; // called once per frame per live particle
-  std::function<void(Particle &)> handleKillParticle = [](Particle &particle){};                              // called upon particle death
-
-  ParticleSim(Graph &graph, PixelStorage<SIZE> &ctx, uint8_t maxSpawnPopulation, uint8_t startingSpeed, unsigned long lifespan, std::vector<EdgeTypesQuad> flowDirections)
-    : graph(graph), ctx(ctx), maxSpawnPopulation(maxSpawnPopulation), startingSpeed(startingSpeed), flowDirections(flowDirections), lifespan(lifespan) {
-    particles.reserve(maxSpawnPopulation);
-    maxSpawnPerSecond = (lifespan > 0 ? 1000 * maxSpawnPopulation / lifespan : 0xFF);
+
+  const PixelSet *spawnPixels = NULL; // pixels to automatically spawn particles on
+  std::vector<ParticleEmitter *> emitters; // spawn each step alongside maintainPopulation, in order. Not owned
+  const PixelSet *allowedPixels = NULL; // pixels that particles are allowed to travel to
+
+  TrailField<SIZE> *trailField = NULL; // if set, trails fade per pixel in the field instead of fading the whole layer. Must draw into this sim's ctx
+
+  // capacity is the most particles that can be alive (or finishing a fade) at once, defaulting to maxSpawnPopulation.
+  // addParticle grows the pool when it's full, but the particles the sim makes itself (spawns, emitters and split copies)
+  // are dropped instead, so split flows usually need more. See ParticlePool for the memory cost per particle.
+  ParticleSim(Graph &graph, PixelStorage<SIZE> &ctx, ParticleIndex maxSpawnPopulation, uint8_t startingSpeed, unsigned long lifespan, std::vector<EdgeTypesQuad> flowDirections, ParticleIndex capacity=0)
+    : maxSpawnPopulation(maxSpawnPopulation), particles(capacity ?: this->maxSpawnPopulation), startingSpeed(startingSpeed), flowDirections(flowDirections), lifespan(lifespan), ctx(ctx), graph(graph) {
+    maxSpawnPerSecond = (lifespan > 0 ? 1000ul * this->maxSpawnPopulation / lifespan : 0xFF);
   };
 
   uint16_t fadeDown = 4 << 8; // fadeToBlackBy units per 1/256 millisecond
 
+  // Particles move on a fixed simulation clock: each update() runs however many steps of stepMillis have elapsed,
+  // so motion doesn't depend on frame rate. After a stall, at most maxStepsPerUpdate are caught up and the rest is dropped.
+  uint8_t stepMillis = 4;
+  uint8_t maxStepsPerUpdate = 50;
+
+  // If set, each step decides every particle's move on these workers in parallel, then applies the moves, kills and splits
+  // in order on the calling core. Flow picks then come from a hash of the particle, step and a seed drawn from random16(),
+  // so the results are the same for any ParticleWorkers, SerialParticleWorkers included.
+  // Hooks still only run on the calling core, but edgeCandidates is called from the workers.
+  ParticleWorkers *workers = NULL;
+
 private:
   PixelStorage<SIZE> &ctx;
   Graph &graph;
 
   unsigned long lastTick = 0;
-  unsigned long lastParticleSpawn = 0;
-  uint8_t fadeUpDistance = 0; // fade up n pixels ahead of particle motion
+  uint32_t spawnCredit = 1000; // particle-milliseconds toward the next maintainPopulation spawn, one particle per 1000
+  unsigned long simMillis = 0; // simulation clock, advanced stepMillis per step
+  unsigned long stepAccumulator = 0; // elapsed time not yet simulated
+  uint32_t particleColorsVersion = 0; // palette version particle colors were last reset from
+  std::unique_ptr<ParticlePool<ParticleIndex> > detachedParticle; // what addParticle hands out past the ParticleIndex limit
+
+  // Occupancy index for collisions: the live particles at each pixel, as a chain from occupancyHeads[px] through occupancyNext.
+  // Relinked every frame and kept up to date through moves, spawns and erases in between. occupancyHeads is only filled
+  // when collisions are turned on, after that a relink only clears the heads its particles were linked at.
+  static constexpr ParticleIndex noParticle = (ParticleIndex)~0;
+  std::vector<ParticleIndex> occupancyHeads; // [pixel]
+  std::vector<ParticleIndex> occupancyNext; // [particle]
+  std::vector<PixelIndex> occupiedPx; // [particle], the pixel it's linked at, or noHop
+  bool pendingErase = false; // collision kills wait until the end of the step so indexes stay put mid-step
+
+  // Two-phase steps, see workers. decideStep fills in a StepDecision per particle, applyStep carries them out.
+  typedef enum : uint8_t { stepNone, stepMove, stepSplit, stepExpire, stepRedecide } StepDecision;
+  std::vector<StepDecision> stepDecisions; // [particle]
+  std::vector<PixelIndex> decidedHops; // [particle], for stepMove. noHop is a leaf
+  std::vector<uint8_t> flowDraws; // [particle], flowRandom16 calls so far this step
+  uint32_t stepSeed = 0;
+
+  // Flow tables, built lazily for priority and weighted flow and rebuilt when anything they depend on changes.
+  // Priority: for each flowDirections entry and vertex, the first two distinct pixels a priority move can go to,
+  // ignoring preventReverseFlow (which only ever needs the second).
+  static constexpr PixelIndex noHop = (PixelIndex)~0;
+  std::vector<PixelIndex> nextHops; // [direction][vertex][2]
+  std::vector<bool> dynamicHops; // [direction][vertex], true where continueTo edges need the dynamic path
+  // Weighted: an alias table per flowDirections entry and vertex, so a weighted pick is two random numbers.
+  // Column i of a table picks aliasHops[i] if random16() < aliasThresholds[i], otherwise aliasAlternates[i].
+  std::vector<unsigned> aliasOffsets; // [direction][vertex] -> first column, plus one past the end
+  std::vector<PixelIndex> aliasHops;
+  std::vector<PixelIndex> aliasAlternates;
+  std::vector<uint16_t> aliasThresholds;
+  FlowRule flowTableRule = random;
+  std::vector<EdgeTypesQuad> flowTableDirections;
+  uint32_t flowTableGraphVersion = 0;
+  const PixelSet *flowTableAllowedPixels = NULL;
+  uint32_t flowTableAllowedPixelsVersion = 0;
+  bool flowTableExactMatch = false;
+  bool flowTableFollowContinueTo = false;
+  bool flowTableValid = false;
 
   PixelIndex spawnLocation() {
     if (spawnPixels) {
-      return spawnPixels->at(random8()%spawnPixels->size());
+      unsigned count = spawnPixels->size();
+      if (count > 0) {
+        return spawnPixels->at(random16()%count);
+      }
     }
     return random16()%ctx.leds.size();
   }
 
-  Particle &makeParticle(Particle *fromParticle=NULL) {
-    assert(particles.size() < 255, "Too many particles");
+  ParticleIndex spawnInto(ParticlePool<ParticleIndex> &pool) {
+    // the particle directions at the Particles level may contain multiple options, choose one at random for this particle
+    EdgeTypesQuad directionsForParticle = flowDirections[random8(flowDirections.size())];
 
-    if (fromParticle) {
-      particles.emplace_back(*fromParticle);
-      particles.back().clearFadeHistory();
-    } else {
-      // the particle directions at the Particles level may contain multiple options, choose one at random for this particle
-      EdgeTypesQuad directionsForParticle = flowDirections[random8(flowDirections.size())];
+    ParticleIndex index = pool.add(spawnLocation(), directionsForParticle, lifespan);
+    pool.speed[index] = startingSpeed;
+    return index;
+  }
 
-      particles.emplace_back(spawnLocation(), directionsForParticle, lifespan);
-      particles.back().setFadeUpDistance(fadeUpDistance);
-      particles.back().speed = startingSpeed;
+  // returns the new particle's index, or -1 if the pool is full
+  int makeParticle(int fromIndex=-1) {
+    if (particles.full()) {
+      return -1;
+    }
+    if (fromIndex >= 0) {
+      return particles.addCopy(fromIndex);
     }
-    return particles.back();
+    return spawnInto(particles);
   }
 
-  void eraseParticle(uint8_t index) {
-    particles.erase(particles.begin() + index);
+  inline bool tracksOccupancy() const {
+    return collisionRule != noCollisions && !occupancyHeads.empty();
   }
 
-  bool killParticle(uint8_t index) {
-    if (particles[index].alive) {
-      particles[index].alive = false;
-      handleKillParticle(particles[index]);
-      if (particles[index].fadeUpDistance == 0) {
+  void occupy(ParticleIndex index) {
+    PixelIndex px = particles.px[index];
+    if (tracksOccupancy() && px < SIZE) {
+      occupancyNext[index] = occupancyHeads[px];
+      occupancyHeads[px] = index;
+      occupiedPx[index] = px;
+    }
+  }
+
+  void vacate(ParticleIndex index) {
+    if (!tracksOccupancy()) {
+      return;
+    }
+    PixelIndex px = occupiedPx[index]; // rather than particles.px, which pattern code may have changed
+    if (px >= SIZE) {
+      return;
+    }
+    occupiedPx[index] = noHop;
+    ParticleIndex *link = &occupancyHeads[px];
+    // bounded in case pattern code moved particles behind the index's back
+    for (unsigned hops = 0; *link != noParticle && hops <= particles.size(); ++hops) {
+      if (*link == index) {
+        *link = occupancyNext[index];
+        return;
+      }
+      link = &occupancyNext[*link];
+    }
+  }
+
+  void rebuildOccupancy() {
+    if (occupancyHeads.empty()) {
+      occupancyHeads.assign(SIZE, noParticle);
+    } else {
+      // only the heads last frame's particles were linked at, so this is O(particles) rather than O(SIZE)
+      for (PixelIndex px : occupiedPx) {
+        if (px < SIZE) {
+          occupancyHeads[px] = noParticle;
+        }
+      }
+    }
+    occupiedPx.assign(particles.capacity(), noHop);
+    occupancyNext.resize(particles.capacity());
+    for (ParticleIndex i = 0; i < particles.size(); ++i) {
+      if (particles.alive(i)) {
+        occupy(i);
+      }
+    }
+  }
+
+  void eraseParticle(ParticleIndex index) {
+    if (!tracksOccupancy()) {
+      particles.remove(index);
+      return;
+    }
+    // the last particle moves into index, so relink it
+    ParticleIndex last = particles.size() - 1;
+    vacate(index);
+    vacate(last);
+    particles.remove(index);
+    if (index != last && particles.alive(index)) {
+      occupy(index);
+    }
+  }
+
+  // returns true if the particle was erased. deferErase leaves that to the end of the step
+  bool killParticle(ParticleIndex index, bool deferErase=false) {
+    if (particles.alive(index)) {
+      particles.flags[index] &= ~ParticlePool<ParticleIndex>::aliveFlag;
+      Particle particle = particles[index];
+      this->onKillParticle(particle);
+      vacate(index);
+      if (particles.fadeUpDistance == 0) {
         // if there is a fade, the particle will be erased when its fade is complete
+        if (deferErase) {
+          pendingErase = true;
+          return false;
+        }
         eraseParticle(index);
         return true;
       }
@@ -262,226 +966,887 @@ private:
     return false;
   }
 
-  void splitParticle(Particle &particle, PixelIndex toPx) {
-    // logf("Splitting particle at %i to %i", particle.px, toPx);
+  // turns a particle around: it won't head back to `from` under preventReverseFlow, and its directions flip where
+  // the graph's transposeMap has a reverse for them. Directions with no transpose (Graph(int) has no transposeMap) take
+  // the types of the edge from `from` back to the particle, so a ring reverses through its decrement edges
+  void reverseParticle(ParticleIndex index, PixelIndex from) {
+    particles.lastPx[index] = from;
+    particles.flags[index] &= ~ParticlePool<ParticleIndex>::nextPxFlag;
+    EdgeTypes backTypes = Edge::none;
+    if (from < graph.vertexCount()) {
+      PixelIndex px = particles.px[index];
+      graph.forEachAdjacent(from, EdgeTypesQuad(Edge::all), [&](const Edge &edge) {
+        if (edge.to == px) {
+          backTypes |= edge.types;
+        }
+      });
+    }
+    EdgeTypesQuad &directions = particles.directions[index];
+    EdgeTypes *types[4] = {&directions.edgeTypes.first, &directions.edgeTypes.second, &directions.edgeTypes.third, &directions.edgeTypes.fourth};
+    for (EdgeTypes *type : types) {
+      EdgeTypes transposed = graph.transpose(*type);
+      if (transposed) {
+        *type = transposed;
+      } else if (*type && backTypes) {
+        *type = backTypes;
+      }
+    }
+  }
+
+  // Moves particle `index` to `to`, applying collisionRule if a live particle is already there. Returns false if it died.
+  bool moveParticle(ParticleIndex index, PixelIndex to, bool collide=true) {
+    bool annihilated = false;
+    if (tracksOccupancy()) {
+      int occupantIndex = (collide ? particleAt(to) : -1);
+      if (occupantIndex >= 0 && occupantIndex != index) {
+        ParticleIndex other = occupantIndex;
+        Particle mover = particles[index];
+        Particle occupant = particles[other];
+        this->onCollision(mover, occupant);
+        switch (collisionRule) {
+          case bounce:
+            reverseParticle(index, to);
+            reverseParticle(other, particles.px[index]);
+            if (workers && other < stepDecisions.size() && stepDecisions[other] == stepMove) {
+              stepDecisions[other] = stepRedecide;
+            }
+            return true;
+          case merge:
+            particles.brightness[other] = qadd8(particles.brightness[other], particles.brightness[index]);
+            particles.color[other] = blend(particles.color[other], particles.color[index], 0x80);
+            killParticle(index, true);
+            return false;
+          case annihilate:
+            killParticle(other, true);
+            annihilated = true;
+            break;
+          default:
+            break;
+        }
+      }
+      vacate(index);
+    }
+    particles.lastPx[index] = particles.px[index];
+    particles.px[index] = to;
+    occupy(index);
+    if (annihilated) {
+      // moves in first so a fade-up trail reaches the meeting point
+      killParticle(index, true);
+      return false;
+    }
+    return true;
+  }
+
+  void splitParticle(ParticleIndex index, PixelIndex toPx) {
+    // logf("Splitting particle at %i to %i", particles.px[index], toPx);
     assert(flowRule == split, "are we splitting or not");
-    Particle &split = makeParticle(&particle);
-    split.px = toPx;
-    split.lastPx = particle.px;
+    int split = makeParticle(index);
+    if (split >= 0) {
+      particles.px[split] = toPx;
+      particles.lastPx[split] = particles.px[index];
+      occupy(split);
+    }
   }
 
-  bool isIndexAllowedForParticle(Particle &particle, PixelIndex index) {
-    if (preventReverseFlow && index == particle.lastPx) {
+  bool isIndexAllowedForParticle(ParticleIndex index, PixelIndex pixel) {
+    if (preventReverseFlow && pixel == particles.lastPx[index]) {
       return false;
     }
     if (allowedPixels) {
-      return allowedPixels->end() != allowedPixels->find(index);
+      return allowedPixels->contains(pixel);
+    }
+    return true;
+  }
+
+  inline bool usesFlowTable() const {
+    return flowRule == priority || flowRule == weighted;
+  }
+
+  bool flowTableIsCurrent() {
+    if (!flowTableValid || flowTableRule != flowRule || flowTableGraphVersion != graph.version || flowTableAllowedPixels != allowedPixels
+        || (allowedPixels && flowTableAllowedPixelsVersion != allowedPixels->version)
+        || flowTableExactMatch != requireExactEdgeTypeMatch || flowTableFollowContinueTo != followContinueTo
+        || flowTableDirections.size() != flowDirections.size()) {
+      return false;
+    }
+    for (unsigned d = 0; d < flowDirections.size(); ++d) {
+      if (flowTableDirections[d].quad != flowDirections[d].quad) {
+        return false;
+      }
     }
     return true;
   }
 
+  void buildPriorityTable() {
+    unsigned vertexCount = graph.vertexCount();
+    nextHops.assign(2 * flowDirections.size() * vertexCount, noHop);
+    dynamicHops.assign(flowDirections.size() * vertexCount, false);
+    for (unsigned d = 0; d < flowDirections.size(); ++d) {
+      for (unsigned v = 0; v < vertexCount; ++v) {
+        unsigned entry = d * vertexCount + v;
+        PixelIndex *hops = &nextHops[2 * entry];
+        for (const Edge &edge : graph.adjacent(v, flowDirections[d], requireExactEdgeTypeMatch)) {
+          if (edge.continueTo) {
+            if (followContinueTo) {
+              dynamicHops[entry] = true;
+              break;
+            }
+          } else if (!allowedPixels || allowedPixels->contains(edge.to)) {
+            if (hops[0] == noHop) {
+              hops[0] = edge.to;
+            } else if (hops[1] == noHop && hops[0] != edge.to) {
+              hops[1] = edge.to;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Vose's alias method over the candidates random flow would consider, weighted by Edge.weight
+  void buildAliasTable() {
+    unsigned vertexCount = graph.vertexCount();
+    aliasOffsets.clear();
+    aliasHops.clear();
+    aliasAlternates.clear();
+    aliasThresholds.clear();
+    for (unsigned d = 0; d < flowDirections.size(); ++d) {
+      for (unsigned v = 0; v < vertexCount; ++v) {
+        aliasOffsets.push_back(aliasHops.size());
+        const Edge *adj[maxEdgeCandidates];
+        uint8_t adjCount = graph.getAdjacencies(v, flowDirections[d], requireExactEdgeTypeMatch, adj, maxEdgeCandidates);
+        PixelIndex hops[maxEdgeCandidates];
+        uint32_t scaled[maxEdgeCandidates]; // weight * column count, so the average column is exactly `total`
+        uint32_t total = 0;
+        uint8_t k = 0;
+        for (uint8_t i = 0; i < adjCount; ++i) {
+          const Edge &edge = *adj[i];
+          if (edge.types && !edge.continueTo && edge.weight && (!allowedPixels || allowedPixels->contains(edge.to))) {
+            hops[k] = edge.to;
+            scaled[k] = edge.weight;
+            total += edge.weight;
+            ++k;
+          }
+        }
+        uint8_t small[maxEdgeCandidates], large[maxEdgeCandidates];
+        uint8_t smallCount = 0, largeCount = 0;
+        for (uint8_t i = 0; i < k; ++i) {
+          scaled[i] *= k;
+          if (scaled[i] < total) {
+            small[smallCount++] = i;
+          } else {
+            large[largeCount++] = i;
+          }
+        }
+        uint16_t thresholds[maxEdgeCandidates];
+        PixelIndex alternates[maxEdgeCandidates];
+        while (smallCount > 0 && largeCount > 0) {
+          uint8_t s = small[--smallCount], l = large[--largeCount];
+          thresholds[s] = ((uint64_t)scaled[s] << 16) / total;
+          alternates[s] = hops[l];
+          scaled[l] -= total - scaled[s];
+          if (scaled[l] < total) {
+            small[smallCount++] = l;
+          } else {
+            large[largeCount++] = l;
+          }
+        }
+        // what's left is full, give or take rounding
+        while (largeCount > 0) {
+          uint8_t l = large[--largeCount];
+          thresholds[l] = 0xFFFF;
+          alternates[l] = hops[l];
+        }
+        while (smallCount > 0) {
+          uint8_t s = small[--smallCount];
+          thresholds[s] = 0xFFFF;
+          alternates[s] = hops[s];
+        }
+        for (uint8_t i = 0; i < k; ++i) {
+          aliasHops.push_back(hops[i]);
+          aliasAlternates.push_back(alternates[i]);
+          aliasThresholds.push_back(thresholds[i]);
+        }
+      }
+    }
+    aliasOffsets.push_back(aliasHops.size());
+  }
+
+  void buildFlowTable() {
+    // only keep the table in use
+    if (flowRule == priority) {
+      buildPriorityTable();
+      std::vector<unsigned>().swap(aliasOffsets);
+      std::vector<PixelIndex>().swap(aliasHops);
+      std::vector<PixelIndex>().swap(aliasAlternates);
+      std::vector<uint16_t>().swap(aliasThresholds);
+    } else {
+      buildAliasTable();
+      std::vector<PixelIndex>().swap(nextHops);
+      std::vector<bool>().swap(dynamicHops);
+    }
+    flowTableRule = flowRule;
+    flowTableDirections = flowDirections;
+    flowTableGraphVersion = graph.version;
+    flowTableAllowedPixels = allowedPixels;
+    flowTableAllowedPixelsVersion = (allowedPixels ? allowedPixels->version : 0);
+    flowTableExactMatch = requireExactEdgeTypeMatch;
+    flowTableFollowContinueTo = followContinueTo;
+    flowTableValid = true;
+  }
+
+  // Priority or weighted move from the flow table. Returns false if the particle needs the dynamic path in edgeCandidates,
+  // otherwise sets hop to the next pixel or noHop if there's nowhere to go.
+  bool tableNextHop(ParticleIndex index, PixelIndex &hop) {
+    if (flowRule == priority && followContinueTo && (particles.flags[index] & ParticlePool<ParticleIndex>::continueToFlag)) {
+      return false;
+    }
+    PixelIndex px = particles.px[index];
+    unsigned vertexCount = graph.vertexCount();
+    if (px >= vertexCount) {
+      return false;
+    }
+    for (unsigned d = 0; d < flowTableDirections.size(); ++d) {
+      if (flowTableDirections[d].quad == particles.directions[index].quad) {
+        unsigned entry = d * vertexCount + px;
+        if (flowRule == weighted) {
+          return aliasNextHop(index, entry, hop);
+        }
+        if (dynamicHops[entry]) {
+          return false;
+        }
+        PixelIndex *hops = &nextHops[2 * entry];
+        hop = (preventReverseFlow && hops[0] == particles.lastPx[index] ? hops[1] : hops[0]);
+        return true;
+      }
+    }
+    return false; // directions were changed to something outside flowDirections
+  }
+
+  // random16() for particle `index`'s flow picks. With workers, a hash of the particle's handle, the step seed and how many
+  // picks it has made this step instead, so picks don't depend on which worker makes them or when
+  uint16_t flowRandom16(ParticleIndex index) {
+    if (!workers || index >= flowDraws.size()) {
+      return random16();
+    }
+    // murmur3's finalizer
+    uint32_t x = stepSeed ^ (particles.handle(index) * 0x9E3779B1u) ^ (flowDraws[index]++ * 0x85EBCA6Bu);
+    x ^= x >> 16;
+    x *= 0x85EBCA6Bu;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35u;
+    x ^= x >> 16;
+    return x >> 16;
+  }
+
+  bool aliasNextHop(ParticleIndex index, unsigned entry, PixelIndex &hop) {
+    unsigned first = aliasOffsets[entry];
+    unsigned columns = aliasOffsets[entry + 1] - first;
+    if (columns == 0) {
+      hop = noHop;
+      return true;
+    }
+    // preventReverseFlow rejects picks of lastPx, which keeps the rest in proportion.
+    // If reversing is most of the weight, leave it to the dynamic path
+    for (uint8_t tries = 0; tries < 8; ++tries) {
+      unsigned column = first + ((uint32_t)flowRandom16(index) * columns >> 16);
+      hop = (flowRandom16(index) < aliasThresholds[column] ? aliasHops[column] : aliasAlternates[column]);
+      if (!preventReverseFlow || hop != particles.lastPx[index]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Chooses the pixel particle `index` moves to next ahead of time, so interpolated drawing can lead into it.
+  // flowParticle then takes this hop rather than searching again.
+  void planNextHop(ParticleIndex index) {
+    PixelIndex hop;
+    if (!(usesFlowTable() && tableNextHop(index, hop))) {
+      const Edge *candidates[maxEdgeCandidates];
+      hop = (edgeCandidates(index, candidates) > 0 ? candidates[0]->to : noHop);
+    }
+    particles.nextPx[index] = hop;
+    particles.flags[index] |= ParticlePool<ParticleIndex>::nextPxFlag;
+  }
+
 public:
-  std::vector<Edge> edgeCandidates(Particle &particle) {
-    std::vector<Edge> nextEdges;
+  // The priority and weighted flow tables are rebuilt automatically when the graph, flowDirections, allowedPixels or the flow flags change.
+  // Call this after changing the graph's adjList directly.
+  void invalidateFlowTable() {
+    flowTableValid = false;
+  }
+
+  static constexpr unsigned maxEdgeCandidates = 4 * GRAPH_MAX_DEGREE; // an edge can match each of the four direction priorities
+
+  // Fills `out` with the edges particle `index` can follow next and returns how many. The edges point into the graph.
+  // Doesn't allocate, so this is what flowParticle uses.
+  uint8_t edgeCandidates(ParticleIndex index, const Edge *out[maxEdgeCandidates]) {
+    const Edge *adj[maxEdgeCandidates];
+    uint8_t adjCount = graph.getAdjacencies(particles.px[index], particles.directions[index], requireExactEdgeTypeMatch, adj, maxEdgeCandidates);
+    uint8_t count = 0;
     switch (flowRule) {
       case priority: {
-        auto adj = graph.adjacencies(particle.px, particle.directions, requireExactEdgeTypeMatch);
-        // logf("edgeCandidates: particle@px %i has %i adjacencies matching directions 0x%x", particle.px, adj.size(), particle.directions.quad);
-        for (auto edge : adj) {
-          // logf("  checking adj %i->%i for edge types 0x%x...", (int)edge.from, (int)edge.to, (int)edge.types);
-          if (isIndexAllowedForParticle(particle, edge.to)) {
+        for (uint8_t i = 0; i < adjCount; ++i) {
+          const Edge &edge = *adj[i];
+          if (isIndexAllowedForParticle(index, edge.to)) {
+            bool hasContinueTo = particles.flags[index] & ParticlePool<ParticleIndex>::continueToFlag;
             if (followContinueTo && edge.continueTo) {
               // continueToPx: stash off the pixel to continue across an intersection where following a single edgeType may be ambiguous
-              particle.continueToPx = edge.to;
-            } else if (followContinueTo && particle.continueToPx == edge.to) {
+              particles.continueToPx[index] = edge.to;
+              particles.flags[index] |= ParticlePool<ParticleIndex>::continueToFlag;
+            } else if (followContinueTo && hasContinueTo && particles.continueToPx[index] == edge.to) {
               // follow the stashed edge
-              nextEdges.clear();
-              nextEdges.push_back(edge);
-              particle.continueToPx.reset();
+              out[0] = &edge;
+              count = 1;
+              particles.flags[index] &= ~ParticlePool<ParticleIndex>::continueToFlag;
               break;
-            } else if (!edge.continueTo) { // regular edge
-              nextEdges.push_back(edge);
+            } else if (!edge.continueTo && count == 0) { // regular edge, only ever follow one in priority mode
+              out[count++] = &edge;
             }
           }
         }
-        if (nextEdges.size() > 0) {
-          // only ever follow one edge in priority mode
-          nextEdges = {nextEdges[0]};
-        }
         break;
       }
       case random:
+      case weighted:
       case split: {
-        auto allAdj = graph.adjacencies(particle.px, particle.directions, requireExactEdgeTypeMatch);
-        std::vector<Edge> allowedEdges;
-        for (auto edge : allAdj) {
-          if (isIndexAllowedForParticle(particle, edge.to) && edge.types && !edge.continueTo) {
-            allowedEdges.push_back(edge);
+        // filter adj down to the allowed edges in place
+        uint8_t allowedCount = 0;
+        for (uint8_t i = 0; i < adjCount; ++i) {
+          if (isIndexAllowedForParticle(index, adj[i]->to) && adj[i]->types && !adj[i]->continueTo) {
+            adj[allowedCount++] = adj[i];
           }
         }
         if (flowRule == split) {
-          if (allowedEdges.size() == 1) {
+          if (allowedCount == 1) {
             // flow normally if we're not actually splitting
-            nextEdges.push_back(allowedEdges.front());
+            out[count++] = adj[0];
           } else {
             // split along all allowed split directions, or none if none are allowed
-            for (Edge nextEdge : allowedEdges) {
-              if ((splitDirections & nextEdge.types) && !nextEdge.continueTo) {
-                nextEdges.push_back(nextEdge);
+            for (uint8_t i = 0; i < allowedCount; ++i) {
+              if (splitDirections & adj[i]->types) {
+                out[count++] = adj[i];
+              }
+            }
+          }
+        } else if (flowRule == weighted) {
+          uint32_t total = 0;
+          for (uint8_t i = 0; i < allowedCount; ++i) {
+            total += adj[i]->weight;
+          }
+          if (total > 0) {
+            uint32_t pick = (uint32_t)flowRandom16(index) * total >> 16;
+            for (uint8_t i = 0; i < allowedCount; ++i) {
+              if (pick < adj[i]->weight) {
+                out[count++] = adj[i];
+                break;
               }
+              pick -= adj[i]->weight;
             }
           }
-        } else if (allowedEdges.size() > 0) {
-          nextEdges.push_back(allowedEdges.at(random8()%allowedEdges.size()));
+        } else if (allowedCount > 0) {
+          out[count++] = adj[(uint32_t)flowRandom16(index) * allowedCount >> 16];
         }
         break;
       }
     }
+    return count;
+  }
+
+  std::vector<Edge> edgeCandidates(ParticleIndex index) {
+    const Edge *candidates[maxEdgeCandidates];
+    uint8_t count = edgeCandidates(index, candidates);
+    std::vector<Edge> nextEdges;
+    for (uint8_t i = 0; i < count; ++i) {
+      nextEdges.push_back(*candidates[i]);
+    }
     return nextEdges;
   }
 
 private:
-  bool flowParticle(uint8_t index) {
-    if (fadeUpDistance > 0) {
-      // scoot the fade-up history
-      for (int d = fadeUpDistance-1; d >= 1; --d) {
-        particles[index].fadeHistory[d] = particles[index].fadeHistory[d-1];
+  // pushes the particle's trail along ahead of a move, or cuts it if the particle is dead
+  void advanceFadeHistory(ParticleIndex index) {
+    if (particles.fadeUpDistance > 0) {
+      if (particles.alive(index)) {
+        particles.pushFadeHistory(index, particles.px[index]);
+      } else {
+        // nothing follows a dead particle, which cuts its trail
+        particles.clearFadeHistory(index);
       }
-      particles[index].fadeHistory[0] = (particles[index].alive ? std::optional<PixelIndex>(particles[index].px) : std::nullopt);
     }
-    
-    if (!particles[index].alive) {
-      return false;
+  }
+
+  // Where particle `index` moves next when it isn't splitting, or noHop if nowhere. Only touches the particle's own state.
+  PixelIndex chooseHop(ParticleIndex index) {
+    bool planned = particles.flags[index] & ParticlePool<ParticleIndex>::nextPxFlag;
+    particles.flags[index] &= ~ParticlePool<ParticleIndex>::nextPxFlag;
+    PixelIndex hop = particles.nextPx[index];
+    // if the planned hop has since become disallowed or there was none, search again
+    if (planned && hop != noHop && isIndexAllowedForParticle(index, hop)) {
+      return hop;
+    }
+    if (usesFlowTable() && tableNextHop(index, hop)) {
+      return hop;
     }
+    const Edge *nextEdges[maxEdgeCandidates];
+    return (edgeCandidates(index, nextEdges) > 0 ? nextEdges[0]->to : noHop);
+  }
 
-    std::vector<Edge> nextEdges = edgeCandidates(particles[index]);
-    if (nextEdges.size() == 0) {
+  // moves a live particle on from its current pixel. Returns false if it died
+  bool routeParticle(ParticleIndex index) {
+    if (flowRule != split) {
+      PixelIndex hop = chooseHop(index);
+      if (hop == noHop) {
+        // leaf behavior
+        killParticle(index);
+        return false;
+      }
+      return moveParticle(index, hop);
+    }
+
+    // split particles search again since they need every candidate, which a plan would only be the first of
+    particles.flags[index] &= ~ParticlePool<ParticleIndex>::nextPxFlag;
+    const Edge *nextEdges[maxEdgeCandidates];
+    uint8_t count = edgeCandidates(index, nextEdges);
+    if (count == 0) {
       // leaf behavior
       // logf("  no path for particle %i", index);
       killParticle(index);
       return false;
-    } else {
-      std::set<PixelIndex> toVertexes; // dedupe
-      for (unsigned i = 0; i < nextEdges.size(); ++i) {
-        toVertexes.insert(nextEdges[i].to);
+    }
+    // dedupe: bit i is set if nextEdges[i] is the first edge to its pixel
+    static_assert(maxEdgeCandidates <= 32, "GRAPH_MAX_DEGREE too large for the split dedupe mask");
+    uint32_t firstToVertex = 0;
+    uint8_t toVertexCount = 0;
+    for (uint8_t i = 0; i < count; ++i) {
+      bool seen = false;
+      for (uint8_t j = 0; j < i && !seen; ++j) {
+        seen = (firstToVertex & (1u << j)) && nextEdges[j]->to == nextEdges[i]->to;
+      }
+      if (!seen) {
+        firstToVertex |= 1u << i;
+        ++toVertexCount;
       }
-      if (toVertexes.size() > 1) {
-        for (PixelIndex idx : toVertexes) {
-          splitParticle(particles[index], idx);
+    }
+    if (toVertexCount > 1) {
+      for (uint8_t i = 0; i < count; ++i) {
+        if (firstToVertex & (1u << i)) {
+          splitParticle(index, nextEdges[i]->to);
         }
       }
-      particles[index].lastPx = particles[index].px;
-      particles[index].px = nextEdges.front().to;
     }
-    return true;
+    return moveParticle(index, nextEdges[0]->to, toVertexCount == 1);
+  }
+
+  bool flowParticle(ParticleIndex index) {
+    advanceFadeHistory(index);
+    if (!particles.alive(index)) {
+      return false;
+    }
+    return routeParticle(index);
   }
 
 public:
+  // the first live particle at px, or -1. Only tracked while collisionRule isn't noCollisions
+  int particleAt(PixelIndex px) {
+    if (!tracksOccupancy() || px >= SIZE) {
+      return -1;
+    }
+    ParticleIndex index = occupancyHeads[px];
+    for (unsigned hops = 0; index != noParticle && hops <= particles.size(); ++hops) {
+      if (index < particles.size() && particles.px[index] == px && particles.alive(index)) {
+        return index;
+      }
+      index = occupancyNext[index];
+    }
+    return -1;
+  }
+
   void dumpParticles() {
     logf("--------");
     logf("There are %i particles", particles.size());
     for (unsigned b = 0; b < particles.size(); ++b) {
-      Particle &particle = particles[b];
+      Particle particle = particles[b];
       logf("Particle %i: px=%i, lifespan=%u, exactAge=%u, colorIndex=%u, speed=%u, directions=%x", b, particle.px, particle.lifespan, particle.exactAge(), particle.colorIndex, particle.speed, particle.directions.quad);
     }
     logf("--------");
   }
 
-  void update() {
-    unsigned long mils = millis();
+private:
+  // evenly in [low, high]. A backwards range is taken as [high, low] rather than wrapping
+  template <typename T>
+  static inline T randomBetween(T low, T high) {
+    if (low == high) {
+      return low;
+    }
+    if (high < low) {
+      std::swap(low, high);
+    }
+    return low + ((uint64_t)random16() * ((uint64_t)high - low + 1) >> 16);
+  }
+
+  // Spawns up to count particles from emitter straight into the pool and returns how many fit
+  unsigned emitParticles(ParticleEmitter &emitter, unsigned count, unsigned long birthmilli, uint8_t extraFlags) {
+    count = min(count, (unsigned)(particles.capacity() - particles.size()));
+    unsigned sourceCount = (emitter.pixels ? emitter.pixels->size() : 1);
+    const std::vector<EdgeTypesQuad> &directions = (emitter.directions.empty() ? flowDirections : emitter.directions);
+    if (sourceCount == 0 || directions.empty()) {
+      return 0;
+    }
+    assert(emitter.minSpeed <= emitter.maxSpeed && emitter.minLifespan <= emitter.maxLifespan && emitter.minBrightness <= emitter.maxBrightness
+           && emitter.minColorIndex <= emitter.maxColorIndex, "ParticleEmitter has a min above its max");
+    for (unsigned n = 0; n < count; ++n) {
+      PixelIndex px = (emitter.pixels ? emitter.pixels->at(randomBetween(0u, sourceCount - 1)) : emitter.px);
+      EdgeTypesQuad particleDirections = directions[randomBetween((size_t)0, directions.size() - 1)];
+      ParticleIndex index = particles.add(px, particleDirections, randomBetween(emitter.minLifespan, emitter.maxLifespan));
+      particles.birthmilli[index] = birthmilli;
+      particles.speed[index] = randomBetween(emitter.minSpeed, emitter.maxSpeed);
+      particles.brightness[index] = randomBetween(emitter.minBrightness, emitter.maxBrightness);
+      particles.colorIndex[index] = randomBetween(emitter.minColorIndex, emitter.maxColorIndex);
+      if (emitter.colorManager) {
+        particles.color[index] = emitter.colorManager->getPaletteColor(particles.colorIndex[index]);
+      }
+      particles.flags[index] |= extraFlags;
+      Particle particle = particles[index];
+      this->onNewParticle(particle);
+      occupy(index);
+    }
+    return count;
+  }
+
+  inline bool lifespanExpired(ParticleIndex index) {
+    // birthmilli comes from millis(), which can be up to a step ahead of simMillis
+    return particles.lifespan[index] != 0 && (long)(simMillis - particles.birthmilli[index]) > (long)particles.lifespan[index];
+  }
+
+  void flowRemainingMoves(ParticleIndex index, uint16_t addProgress=0) {
+    // a step's worth of progress goes up to 255 * 255, so add in 32 bits. Less one move, it fits back in 16.
+    // Stored before each move since a particle that dies can have another swapped into its index
+    uint32_t progress = particles.moveProgress[index] + (uint32_t)addProgress;
+    while (progress >= 1000) {
+      progress -= 1000;
+      particles.moveProgress[index] = progress;
+      if (!flowParticle(index)) {
+        return;
+      }
+    }
+    particles.moveProgress[index] = progress;
+  }
+
+  // Phase one of a two-phase step, run on the workers: the first move of this step for particle `index`, as far as it can be
+  // worked out from the particle alone. Kills, splits and collisions are left to applyStep.
+  void decideStep(ParticleIndex index) {
+    StepDecision &decision = stepDecisions[index];
+    decision = stepNone;
+    flowDraws[index] = 0;
+    if (!(particles.flags[index] & ParticlePool<ParticleIndex>::flowingFlag)) {
+      return;
+    }
+    if (lifespanExpired(index) && particles.alive(index)) {
+      decision = stepExpire;
+      return;
+    }
+    uint32_t progress = particles.moveProgress[index] + (uint32_t)stepMillis * particles.speed[index]; // see flowRemainingMoves
+    if (progress < 1000) {
+      particles.moveProgress[index] = progress;
+      return;
+    }
+    particles.moveProgress[index] = progress - 1000;
+    advanceFadeHistory(index);
+    if (!particles.alive(index)) {
+      return;
+    }
+    if (flowRule == split) {
+      decision = stepSplit;
+    } else {
+      decidedHops[index] = chooseHop(index);
+      decision = stepMove;
+    }
+  }
+
+  // Phase two, on the calling core in the sequential loop's order
+  void applyStep(ParticleIndex index) {
+    switch (stepDecisions[index]) {
+      case stepExpire:
+        if (killParticle(index)) {
+          return;
+        }
+        flowRemainingMoves(index, stepMillis * particles.speed[index]);
+        return;
+      case stepMove:
+        if (!particles.alive(index)) {
+          return; // merged or annihilated by an earlier move this step
+        }
+        if (decidedHops[index] == noHop) {
+          // leaf behavior
+          killParticle(index);
+          return;
+        }
+        if (!moveParticle(index, decidedHops[index])) {
+          return;
+        }
+        break;
+      case stepSplit:
+        if (!particles.alive(index) || !routeParticle(index)) {
+          return;
+        }
+        break;
+      case stepRedecide:
+        // turned around by a bounce since its move was decided
+        if (!particles.alive(index) || !routeParticle(index)) {
+          return;
+        }
+        break;
+      default:
+        return;
+    }
+    flowRemainingMoves(index);
+  }
+
+  void step() {
+    simMillis += stepMillis;
 
-    ctx.fadeToBlackBy16(fadeDown);
-    
     if (spawnRule == maintainPopulation) {
-      for (unsigned b = particles.size(); b < maxSpawnPopulation; ++b) {
-        if (maxSpawnPerSecond != 0 && mils - lastParticleSpawn < 1000 / maxSpawnPerSecond) {
+      // spawn credit builds up at maxSpawnPerSecond, so any rate works, including several spawns per step
+      spawnCredit += stepMillis * maxSpawnPerSecond;
+      while (particles.size() < maxSpawnPopulation && !particles.full() && (maxSpawnPerSecond == 0 || spawnCredit >= 1000)) {
+        Particle particle = addParticle();
+        // born on the simulation clock, so spawns line up the same at any frame rate
+        particle.birthmilli = simMillis;
+        particles.flags[particles.indexOf(particle.handle())] |= ParticlePool<ParticleIndex>::flowingFlag;
+        spawnCredit -= min(spawnCredit, (uint32_t)1000);
+      }
+      // don't bank spawns while the population is full
+      spawnCredit = min(spawnCredit, (uint32_t)1000);
+    }
+
+    for (ParticleEmitter *emitter : emitters) {
+      unsigned count = emitter->pendingBurst;
+      emitter->pendingBurst = 0;
+      if (emitter->enabled && emitter->rate > 0) {
+        emitter->rateCredit += stepMillis * emitter->rate;
+        count += emitter->rateCredit / 1000;
+        emitter->rateCredit %= 1000;
+      }
+      if (count > 0) {
+        emitParticles(*emitter, count, simMillis, ParticlePool<ParticleIndex>::flowingFlag);
+      }
+    }
+
+    if (workers) {
+      // phase one decides each particle's move from its own state in parallel, phase two applies the decisions in the same
+      // order the sequential loop below would
+      ParticleIndex count = particles.size();
+      stepSeed = (uint32_t)random16() << 16 | random16();
+      workers->run(count, [this](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end; ++i) {
+          decideStep(i);
+        }
+      });
+      for (int i = count - 1; i >= 0; --i) {
+        applyStep(i);
+      }
+    } else {
+      // iterate backward so that swap-removes and splits only touch particles that were already updated this step
+      for (int i = particles.size() - 1; i >= 0; --i) {
+        if (!(particles.flags[i] & ParticlePool<ParticleIndex>::flowingFlag)) {
+          // don't flow particles made outside the simulation before they're drawn. this allows pattern code to make their own particles that are displayed before being flowed
           continue;
         }
-        addParticle();
-        lastParticleSpawn = mils;
+        if (lifespanExpired(i) && killParticle(i)) {
+          continue;
+        }
+        flowRemainingMoves(i, stepMillis * particles.speed[i]);
       }
     }
 
-    bool firstFrameForParticle[particles.size()];
-    for (int i = 0 ; i < particles.size(); ++i) {
-      firstFrameForParticle[i] = (particles[i].lastMove == 0);
+    if (pendingErase) {
+      for (int i = particles.size() - 1; i >= 0; --i) {
+        if (!particles.alive(i)) {
+          eraseParticle(i);
+        }
+      }
+      pendingErase = false;
     }
 
-    // // Update! // //
-    
-    for (int i = particles.size() - 1; i >= 0; --i) {
-      if (firstFrameForParticle[i]) {
-        // don't flow particles on the first frame. this allows pattern code to make their own particles that are displayed before being flowed
-        particles[i].lastMove = mils;
-      } else {
-        bool particleKilled=false;
-        if (particles[i].lifespan != 0 && particles[i].exactAge() > particles[i].lifespan) {
-          particleKilled = killParticle(i);
-        }
-        if (!particleKilled && mils - particles[i].lastMove > 1000/particles[i].speed) {
-          if (flowParticle(i)) { // possibly reallocates particles vector or destroys the particle
-            if (mils - particles[i].lastMove > 2000/particles[i].speed) {
-              particles[i].lastMove = mils;
-            } else {
-              // This helps avoid time drift, which for some reason can make one device run consistently faster than another
-              particles[i].lastMove += 1000/particles[i].speed;
-            }
-          }
+    if (interpolateMotion && particles.fadeUpDistance == 0) {
+      // plan here rather than when drawing: random and weighted plans use random numbers, so they have to happen on the
+      // simulation clock for the simulation not to depend on frame rate
+      for (ParticleIndex i = 0; i < particles.size(); ++i) {
+        if (particles.alive(i) && !(particles.flags[i] & ParticlePool<ParticleIndex>::nextPxFlag)) {
+          planNextHop(i);
         }
       }
     }
+  }
+
+  struct TrailStyle {
+    CRGB color;
+    uint16_t fadeDown;
+  };
+
+  TrailStyle trailStyle(ParticleIndex index) {
+    TrailStyle style = {particles.color[index], fadeDown};
+    if (trailField) {
+      Particle particle = particles[index];
+      this->onTrail(particle, style.color, style.fadeDown);
+    }
+    return style;
+  }
+
+  inline void drawPoint(PixelIndex px, CRGB color, uint8_t brightness, const TrailStyle &trail) {
+    ctx.point(px, color, blendBrighten, brightness);
+    if (trailField) {
+      trailField->deposit(px, trail.color, brightness, trail.fadeDown);
+    }
+  }
+
+  // how far particle `index` is toward its next move as of this frame, 0-0xFF
+  uint8_t renderProgress(ParticleIndex index) {
+    if (!(particles.flags[index] & ParticlePool<ParticleIndex>::flowingFlag)) {
+      return 0;
+    }
+    uint32_t progress = particles.moveProgress[index] + stepAccumulator * particles.speed[index];
+    return min((uint32_t)0xFF, progress * 0x100 / 1000);
+  }
+
+public:
+  void update() {
+    unsigned long mils = millis();
+
+    if (trailField) {
+      trailField->update();
+    } else {
+      ctx.fadeToBlackBy16(fadeDown);
+    }
+
+    // // Update! // //
+
+    if (usesFlowTable() && !flowTableIsCurrent()) {
+      buildFlowTable();
+    }
+    if (collisionRule != noCollisions) {
+      // pattern code may have moved particles since the last frame
+      rebuildOccupancy();
+    } else if (!occupancyHeads.empty()) {
+      // the index isn't kept up to date with collisions off, so start over if they're turned back on
+      std::vector<ParticleIndex>().swap(occupancyHeads);
+      std::vector<ParticleIndex>().swap(occupancyNext);
+      std::vector<PixelIndex>().swap(occupiedPx);
+    }
+    if (workers && stepDecisions.size() != particles.capacity()) {
+      stepDecisions.assign(particles.capacity(), stepNone);
+      decidedHops.assign(particles.capacity(), noHop);
+      flowDraws.assign(particles.capacity(), 0);
+    }
+
+    uint8_t stepLength = max(stepMillis, 1);
+    if (lastTick == 0) {
+      simMillis = mils - stepLength;
+      stepAccumulator = stepLength; // one step on the first frame so spawning starts right away
+    } else {
+      stepAccumulator += mils - lastTick;
+    }
+    uint8_t steps = 0;
+    while (stepAccumulator >= stepLength) {
+      if (steps++ == maxStepsPerUpdate) {
+        // too far behind, skip ahead rather than stall
+        simMillis += stepAccumulator - stepAccumulator % stepLength;
+        stepAccumulator %= stepLength;
+        break;
+      }
+      step();
+      stepAccumulator -= stepLength;
+    }
 
     // // Draw! // //
 
-    if (fadeUpDistance == 0) {
-      for (Particle &p : particles) {
-        if (!p.alive) continue;
-        CRGB newColor = CRGB(p.color).nscale8(p.brightness);
-        ctx.point(p.px, newColor, blendBrighten);
+    uint8_t fadeUpDistance = particles.fadeUpDistance;
+    if (fadeUpDistance == 0 && interpolateMotion) {
+      for (ParticleIndex i = 0; i < particles.size(); ++i) {
+        if (!particles.alive(i)) continue;
+        // split brightness between px and the next hop by how far along the particle is to its next move.
+        // Particles added since the last step don't have a plan yet
+        bool planned = (particles.flags[i] & ParticlePool<ParticleIndex>::nextPxFlag) && particles.nextPx[i] != noHop;
+        uint8_t progress = (planned ? renderProgress(i) : 0);
+        uint8_t brightness = particles.brightness[i];
+        TrailStyle trail = trailStyle(i);
+        drawPoint(particles.px[i], particles.color[i], scale8(0xFF - progress, brightness), trail);
+        if (progress > 0) {
+          drawPoint(particles.nextPx[i], particles.color[i], scale8(progress, brightness), trail);
+        }
+        particles.flags[i] |= ParticlePool<ParticleIndex>::flowingFlag;
+      }
+    } else if (fadeUpDistance == 0) {
+      for (ParticleIndex i = 0; i < particles.size(); ++i) {
+        if (!particles.alive(i)) continue;
+        drawPoint(particles.px[i], particles.color[i], particles.brightness[i], trailStyle(i));
+        particles.flags[i] |= ParticlePool<ParticleIndex>::flowingFlag;
       }
     } else { // fade up
       for (int index = particles.size() - 1; index >= 0; --index) {
-        Particle &p = particles[index];
-        bool activelyFading = false;
-        for (int d = 0; d < p.fadeUpDistance+1; ++d) {
-          PixelIndex px;
-          if (d == 0) {
-            px = p.px;
-          } else {
-            if (!p.fadeHistory[d-1].has_value()) {
-              break;
-            }
-            px = p.fadeHistory[d-1].value();
-            activelyFading = true;
-          }
-          uint16_t interMoveScale = (firstFrameForParticle[index] ? 0 : (1<<16-1) * (mils - p.lastMove) * p.speed / 1000);
-          uint8_t blendAmount = min(0xFF, d * 0xFF / p.fadeUpDistance + scale16(0xFF/p.fadeUpDistance, interMoveScale));
-          blendAmount = scale8(blendAmount, p.brightness);
-          ctx.point(px, p.color, blendBrighten, blendAmount);
+        uint8_t historyLength = particles.fadeLength[index];
+        bool activelyFading = (historyLength > 0);
+        TrailStyle trail = trailStyle(index);
+        for (int d = 0; d < historyLength+1; ++d) {
+          PixelIndex px = (d == 0 ? particles.px[index] : particles.fadeHistoryAt(index, d-1));
+          // particles on their first frame have no progress
+          uint16_t interMoveScale = (1<<16-1) * renderProgress(index) / 0x100;
+          uint8_t blendAmount = min(0xFF, d * 0xFF / fadeUpDistance + scale16(0xFF/fadeUpDistance, interMoveScale));
+          blendAmount = scale8(blendAmount, particles.brightness[index]);
+          drawPoint(px, particles.color[index], blendAmount, trail);
         }
-        if (!p.alive && !activelyFading) {
+        particles.flags[index] |= ParticlePool<ParticleIndex>::flowingFlag;
+        if (!particles.alive(index) && !activelyFading) {
           eraseParticle(index);
         }
       }
     }
 
-    uint8_t i = 0;
-    for (Particle &p : particles) {
-      if (p.alive) {
-        handleUpdateParticle(p, i++);
-      }
-    }
+    ParticleSpan<ParticleIndex> span = particles.span();
+    this->onUpdateParticles(span);
 
     lastTick = mils;
   };
 
-  Particle &addParticle() {
-    Particle &newbit = makeParticle();
-    handleNewParticle(newbit);
+  // Adds a particle at a spawn location. When the pool is full it grows, which allocates, so give the sim enough capacity
+  // for the particles pattern code adds. Past the ParticleIndex limit it can't grow: this asserts and returns a detached
+  // particle that isn't simulated or drawn
+  Particle addParticle() {
+    if (particles.full()) {
+      unsigned limit = noParticle; // noParticle is never an index, so it's the most a pool can hold
+      unsigned grown = min(limit, max(8u, 2u * particles.capacity()));
+      if (grown > particles.capacity()) {
+        particles.reserve(grown);
+        if (!occupancyNext.empty()) {
+          occupancyNext.resize(grown);
+          occupiedPx.resize(grown, noHop);
+        }
+      }
+    }
+    if (particles.full()) {
+      assert(false, "ParticleSim limit of %u particles reached", particles.capacity());
+      if (!detachedParticle) {
+        detachedParticle.reset(new ParticlePool<ParticleIndex>(1));
+      }
+      detachedParticle->clear();
+      return (*detachedParticle)[spawnInto(*detachedParticle)];
+    }
+    ParticleIndex index = makeParticle();
+    Particle newbit = particles[index];
+    this->onNewParticle(newbit);
+    occupy(index);
     return newbit;
   }
 
-  void removeParticle(uint8_t index) {
+  // Spawns up to count particles from emitter right away and returns how many fit. Like addParticle, they start flowing
+  // once drawn. The emitter doesn't need to be in emitters
+  unsigned emit(ParticleEmitter &emitter, unsigned count) {
+    return emitParticles(emitter, count, millis(), 0);
+  }
+
+  void removeParticle(ParticleIndex index) {
     killParticle(index);
   }
 
@@ -490,24 +1855,34 @@ public:
   }
 
   void resetParticleColors(ColorManager *colorManager) {
-    for (Particle &p : particles) {
-      p.color = colorManager->getPaletteColor(p.colorIndex, p.color.getAverageLight());
+    for (ParticleIndex i = 0; i < particles.size(); ++i) {
+      particles.color[i] = colorManager->getPaletteColor(particles.colorIndex[i], particles.color[i].getAverageLight());
+    }
+  }
+
+  // Recolors particles from colorIndex when the palette has changed since the last recolor, cheap enough to call every frame.
+  // Colors are set at full brightness and dimming is left to Particle.brightness, so repeated recolors don't darken
+  // the way repeated resetParticleColors calls do
+  void updateParticleColors(ColorManager *colorManager) {
+    uint32_t paletteVersion = colorManager->paletteVersion();
+    if (paletteVersion != particleColorsVersion) {
+      for (ParticleIndex i = 0; i < particles.size(); ++i) {
+        particles.color[i] = colorManager->getPaletteColor(particles.colorIndex[i]);
+      }
+      particleColorsVersion = paletteVersion;
     }
   }
 
   void setAllSpeed(uint8_t newSpeed) {
     this->startingSpeed = newSpeed;
-    for (Particle &p : particles) {
-      p.speed = newSpeed;
+    for (ParticleIndex i = 0; i < particles.size(); ++i) {
+      particles.speed[i] = newSpeed;
     }
   }
-  
+
   void setFadeUpDistance(uint8_t distance) {
-    if (distance != fadeUpDistance) {
-      for (Particle &p : particles) {
-        p.setFadeUpDistance(distance);
-      }
-      fadeUpDistance = distance;
+    if (distance != particles.fadeUpDistance) {
+      particles.setFadeUpDistance(distance);
     }
   }
 };
@@ -10,7 +10,12 @@
 #include <drawing.h>
 #include <paletting.h>
 
+#if DUSTLIB_KEYFRAME_COLORMANAGER
+// keyframe palettes for low-RAM parts e.g. samd21g, ~300 bytes instead of ~3KB
+using ColorManager = PaletteRotation<KeyframePalette16>;
+#else
 using ColorManager = PaletteRotation<CRGBPalette256>;
+#endif
 #if DUSTLIB_SHARED_COLORMANAGER
 ColorManager sharedColorManager;
 #endif
@@ -49,7 +54,8 @@ public:
     }
   }
 
-  void composeIntoContext(DrawingContext &otherContext) {
+  // steps the alpha animation and returns the brightness to compose at this frame
+  uint8_t composeBrightness() {
     if (alpha != targetAlpha) {
       if (abs(targetAlpha - alpha) < animationSpeed) {
         alpha = targetAlpha;
@@ -57,8 +63,13 @@ public:
         alpha += animationSpeed * sgn((int)targetAlpha - (int)alpha);
       }
     }
+    return scale8(alpha, maxAlpha);
+  }
+
+  void composeIntoContext(DrawingContext &otherContext) {
+    uint8_t brightness = composeBrightness();
     if (alpha > 0) {
-      this->ctx.blendIntoContext(otherContext, BlendMode::blendBrighten, scale8(alpha, maxAlpha));
+      this->ctx.blendIntoContext(otherContext, BlendMode::blendBrighten, brightness);
     }
   }
 };
@@ -381,9 +392,14 @@ public:
 // A pattern runner that can crossfade between patterns in the given group and automatically switch between them by timeout
 class CrossfadingPatternRunner : public IndexedPatternRunner {
   Pattern *crossfadePattern = NULL;
+
+  uint8_t crossfadeProgress() {
+    return constrain((int)(0xFF * crossfadePattern->runTime() / crossfadeDuration), 0, 0xFF);
+  }
 public:
   unsigned long patternTimeout = 0; // millis, 0 for no autotimeout
   unsigned long crossfadeDuration = 500;
+  BlendSpace crossfadeBlendSpace = blendSpaceRGB; // blendSpaceOklab interpolates each pixel between the two patterns instead of cross-dimming them
   std::function<void(CrossfadingPatternRunner &)> timeoutRule = [](CrossfadingPatternRunner &) {}; // called on patternTimeout
 
   CrossfadingPatternRunner(PatternManager &manager, int startPatternIndex, int groupID=0) : IndexedPatternRunner(manager, startPatternIndex, groupID) { }
@@ -435,20 +451,31 @@ public:
           crossfadePattern->start();
         }
       }
-      if (crossfadePattern) {
-        pattern->maxAlpha = dim8_raw(constrain((int)(0xFF - 0xFF * crossfadePattern->runTime() / crossfadeDuration), 0, 0xFF));
+      if (crossfadePattern && crossfadeBlendSpace == blendSpaceRGB) {
+        pattern->maxAlpha = dim8_raw(0xFF - crossfadeProgress());
       } else {
         pattern->maxAlpha = 0xFF;
       }
     }
     if (crossfadePattern && !paused) {
-      crossfadePattern->maxAlpha = dim8_raw(constrain((int)(0xFF * crossfadePattern->runTime() / crossfadeDuration), 0, 0xFF));
+      crossfadePattern->maxAlpha = (crossfadeBlendSpace == blendSpaceRGB ? dim8_raw(crossfadeProgress()) : 0xFF);
       crossfadePattern->loop();
     }
     PatternRunner::loop();
   }
   
   virtual void draw(DrawingContext &ctx) {
+    if (crossfadePattern && !paused && crossfadeBlendSpace == blendSpaceOklab && pattern && pattern->isRunning()) {
+      uint8_t fromBrightness = pattern->composeBrightness();
+      uint8_t toBrightness = crossfadePattern->composeBrightness();
+      uint8_t progress = crossfadeProgress();
+      for (unsigned i = 0; i < ctx.count; ++i) {
+        CRGB from = CRGB(pattern->ctx.leds[i]).nscale8(fromBrightness);
+        CRGB to = CRGB(crossfadePattern->ctx.leds[i]).nscale8(toBrightness);
+        ctx.point(i, Oklab::blend(from, to, progress), blendBrighten);
+      }
+      return;
+    }
     if (crossfadePattern && !paused) {
       crossfadePattern->composeIntoContext(ctx);
     }